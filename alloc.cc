@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Replaces the global operator new of the binary to count allocations.
+ * The default nothrow and array forms end up here as well, delete keeps
+ * using the default one, which calls free().
+ */
+
+#include "alloc.hh"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+	std::atomic<std::uint64_t> allocations{ 0 };
+}
+
+void* operator new(std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (size == 0)
+		size = 1;
+	for (;;) {
+		if (void* p = std::malloc(size))
+			return p;
+		auto const handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc{};
+		handler();
+	}
+}
+
+namespace powercap {
+
+	std::uint64_t allocation_count() {
+		return allocations.load(std::memory_order_relaxed);
+	}
+}
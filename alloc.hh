@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstdint>
+
+namespace powercap {
+
+	// Number of heap allocations through operator new so far. The watch
+	// loop uses it to make sure it does not allocate once it settled.
+	std::uint64_t allocation_count();
+}
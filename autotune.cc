@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * A loaded card draws about what its cap allows, but not right away: the
+ * SMU takes a moment to notice, and then walks its clocks towards the new
+ * limit. We model that as a first order process with dead time and fit it
+ * with the two point method: where the step response crosses 28.3% and
+ * 63.2% of the change gives the time constant and the delay.
+ *
+ * The cap is stepped down by a third of the range below the maximum and
+ * back up, and the results of both steps are averaged. The original cap is
+ * restored at the end, also when interrupted.
+ *
+ * The dynamics are plain text, one line per pci slot:
+ *
+ * 0000:03:00.0 0.94 400 900 3100
+ *
+ * The gain, the delay and time constant in ms, and the control interval in
+ * ms derived from them.
+ */
+
+#include "autotune.hh"
+#include "expr.hh"
+#include "sysfs.hh"
+#include "trial.hh"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace powercap {
+
+	namespace {
+
+		using clock = std::chrono::steady_clock;
+
+		// Fine enough to see a delay of a few hundred ms
+		constexpr std::chrono::milliseconds sample_interval{ 50 };
+		// The draw has to settle at the maximum before we step down
+		constexpr std::chrono::seconds settle_time{ 3 };
+		constexpr std::chrono::seconds baseline_time{ 2 };
+		// Share of the range below the maximum the cap steps down
+		constexpr double step_size = 1.0 / 3;
+		// A smaller response is noise, the card is not limited by its cap
+		constexpr double min_response = 3;
+		// A controller should not look before the response has settled,
+		// which takes about three time constants after the delay
+		constexpr double settle_time_constants = 3;
+		constexpr std::chrono::milliseconds min_interval{ 2000 };
+
+		struct Entry {
+			std::string slot;
+			Dynamics dynamics;
+		};
+
+		std::vector<Entry> load_dynamics() {
+			std::vector<Entry> result;
+			auto const content = read_file(dynamics_file);
+			if (not content.has_value())
+				return result;
+			for_each_line(*content, [&result](std::string_view line) {
+				Entry e;
+				e.slot = std::string{ next_token(line) };
+				std::uint64_t delay, time_constant, interval;
+				if (e.slot.empty() or not to_double(next_token(line), e.dynamics.gain)
+					or not to_uint64(next_token(line), delay)
+					or not to_uint64(next_token(line), time_constant)
+					or not to_uint64(next_token(line), interval))
+					return;
+				e.dynamics.delay = std::chrono::milliseconds{ delay };
+				e.dynamics.time_constant = std::chrono::milliseconds{ time_constant };
+				e.dynamics.interval = std::chrono::milliseconds{ interval };
+				result.push_back(std::move(e));
+			});
+			return result;
+		}
+
+		int save_dynamics(std::vector<Entry> const& entries) {
+			std::string content;
+			for (auto const& e : entries) {
+				char nums[96];
+				std::snprintf(nums, sizeof(nums), " %.3f %lld %lld %lld\n", e.dynamics.gain,
+					static_cast<long long>(e.dynamics.delay.count()),
+					static_cast<long long>(e.dynamics.time_constant.count()),
+					static_cast<long long>(e.dynamics.interval.count()));
+				content += e.slot + nums;
+			}
+			return save_table(dynamics_file, content);
+		}
+
+		struct Sample {
+			double seconds;
+			double watts;
+		};
+
+		// The raw readings, the estimate would add a lag of its own.
+		// power1_input where the card has it, it does not average.
+		class Probe {
+		public:
+			explicit Probe(std::string const& hwmon)
+				: m_input{ hwmon + "/power1_input" }
+				, m_average{ hwmon + "/power1_average" }
+			{}
+
+			std::optional<double> watts() {
+				auto uw = m_input.read_uint64();
+				if (uw.value_or(0) == 0)
+					uw = m_average.read_uint64();
+				if (not uw.has_value())
+					return {};
+				return static_cast<double>(*uw) / 1e6;
+			}
+
+			std::vector<Sample> follow(clock::duration d) {
+				std::vector<Sample> result;
+				auto const start = clock::now();
+				while (not interrupted and clock::now() - start < d) {
+					std::this_thread::sleep_for(sample_interval);
+					if (auto const w = watts())
+						result.push_back(Sample{ std::chrono::duration<double>(clock::now() - start).count(), *w });
+				}
+				return result;
+			}
+
+		private:
+			Attribute m_input;
+			Attribute m_average;
+		};
+
+		double mean(std::vector<Sample>::const_iterator begin, std::vector<Sample>::const_iterator end) {
+			double sum = 0;
+			for (auto i = begin; i != end; ++i)
+				sum += i->watts;
+			return begin == end ? 0 : sum / static_cast<double>(end - begin);
+		}
+
+		// Fits the step response, the draw settled at before until the cap
+		// changed by cap_change (W)
+		std::optional<Dynamics> fit(std::vector<Sample> const& samples, double before, double cap_change) {
+			if (samples.size() < 8)
+				return {};
+			// The last quarter is where it settled
+			auto const after = mean(samples.end() - static_cast<std::ptrdiff_t>(samples.size() / 4), samples.end());
+			auto const change = after - before;
+			if (std::abs(change) < min_response)
+				return {};
+
+			// The first crossing of a moving average over three samples,
+			// single readings are too noisy
+			auto const crossing = [&](double share) -> std::optional<double> {
+				for (std::size_t i = 2; i < samples.size(); ++i) {
+					auto const w = (samples[i - 2].watts + samples[i - 1].watts + samples[i].watts) / 3;
+					if ((w - before) / change >= share)
+						return samples[i - 1].seconds;
+				}
+				return {};
+			};
+			auto const t28 = crossing(0.283);
+			auto const t63 = crossing(0.632);
+			if (not t28 or not t63)
+				return {};
+
+			auto const tau = std::max(1.5 * (*t63 - *t28), 0.0);
+			auto const delay = std::max(*t63 - tau, 0.0);
+			auto const ms = [](double s) { return std::chrono::milliseconds{ static_cast<long long>(s * 1000) }; };
+			Dynamics d;
+			d.gain = change / cap_change;
+			d.delay = ms(delay);
+			d.time_constant = ms(tau);
+			return d;
+		}
+
+		// Nothing if the card was not busy or did not follow its cap
+		std::optional<Dynamics> tune_card(std::string const& hwmon, AutotuneOptions const& o) {
+			CardAttributes attrs{ hwmon };
+			auto const min = attrs.cap_min();
+			auto const max = attrs.cap_max();
+			auto const original = attrs.cap();
+			auto const slot = pci_slot_of(hwmon);
+			if (not min or not max or not original or *max <= *min) {
+				std::fprintf(stderr, "%s does not allow to set a power-limit\n", hwmon.c_str());
+				return {};
+			}
+			auto const low = whole_watts(*max - static_cast<std::uint64_t>((*max - *min) * step_size));
+			auto const cap_change = (static_cast<double>(*max) - static_cast<double>(low)) / 1e6;
+
+			Probe probe{ hwmon };
+			std::optional<Dynamics> down, up;
+			CapTrial trial{ hwmon, *original, "Tuning " + slot };
+			if (not trial.claimed())
+				return {};
+			if (trial.set(*max) == 0) {
+				std::this_thread::sleep_for(settle_time);
+				auto const settled = probe.follow(baseline_time);
+				if (attrs.sample(1u << Signal::Busy)[Signal::Busy] < loaded_busy_percent)
+					std::fprintf(stderr, "%s: the card was not busy, skipped\n", slot.c_str());
+				else if (trial.set(low) == 0) {
+					auto const falling = probe.follow(std::chrono::seconds{ o.seconds });
+					down = fit(falling, mean(settled.begin(), settled.end()), -cap_change);
+					if (down and trial.set(*max) == 0) {
+						auto const rising = probe.follow(std::chrono::seconds{ o.seconds });
+						up = fit(rising, mean(falling.end() - static_cast<std::ptrdiff_t>(falling.size() / 4),
+							falling.end()), cap_change);
+					}
+				}
+			}
+			if (interrupted)
+				return {};
+			if (not down or not up) {
+				std::fprintf(stderr, "%s: the draw did not follow the cap, skipped\n", slot.c_str());
+				return {};
+			}
+
+			Dynamics d;
+			d.gain = (down->gain + up->gain) / 2;
+			d.delay = (down->delay + up->delay) / 2;
+			d.time_constant = (down->time_constant + up->time_constant) / 2;
+			auto const settle = d.delay + std::chrono::duration_cast<std::chrono::milliseconds>(
+				d.time_constant * settle_time_constants);
+			d.interval = std::max(settle, min_interval);
+			std::printf("%s: gain %.2f, delay %lldms, time constant %lldms, control interval %lldms\n", slot.c_str(),
+				d.gain, static_cast<long long>(d.delay.count()), static_cast<long long>(d.time_constant.count()),
+				static_cast<long long>(d.interval.count()));
+			return d;
+		}
+	}
+
+	int autotune(AutotuneOptions const& o) {
+		auto const hwmons = o.device
+			? std::vector<std::string>{ find_hwmon_base_path_for_device(o.device) }
+			: find_all_hwmon_base_paths();
+		if (hwmons.empty() or hwmons.front().empty()) {
+			std::fprintf(stderr, "Unable to find gpu\n");
+			return 1;
+		}
+
+		catch_interrupts();
+
+		auto all = load_dynamics();
+		for (auto const& hwmon : hwmons) {
+			auto const d = tune_card(hwmon, o);
+			if (interrupted) {
+				std::fprintf(stderr, "Interrupted, nothing saved\n");
+				return 1;
+			}
+			if (not d.has_value())
+				continue;
+			auto const slot = pci_slot_of(hwmon);
+			all.erase(std::remove_if(all.begin(), all.end(), [&slot](Entry const& e) { return e.slot == slot; }),
+				all.end());
+			all.push_back(Entry{ slot, *d });
+		}
+		if (auto const err = save_dynamics(all); err < 0) {
+			std::fprintf(stderr, "Could not write %s: %s\n", dynamics_file, std::strerror(-err));
+			return 1;
+		}
+		return 0;
+	}
+
+	std::optional<Dynamics> dynamics_of(std::string const& hwmon) {
+		auto const slot = pci_slot_of(hwmon);
+		for (auto const& e : load_dynamics())
+			if (e.slot == slot)
+				return e.dynamics;
+		return {};
+	}
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+namespace powercap {
+
+	constexpr char const* dynamics_file = "/var/lib/powercap/dynamics";
+
+	struct AutotuneOptions {
+		// Only tune this card, otherwise all of them
+		char const* device = nullptr;
+		// Time each step is followed for
+		unsigned seconds = 10;
+	};
+
+	// How the draw of a card follows its cap, identified by a step test
+	struct Dynamics {
+		// Change of the draw per change of the cap
+		double gain = 0;
+		// Until the draw starts to move, and how long it then takes to get
+		// 63% of the way
+		std::chrono::milliseconds delay{};
+		std::chrono::milliseconds time_constant{};
+		// How long a controller waits for a cap change to show, derived
+		// from the above
+		std::chrono::milliseconds interval{};
+	};
+
+	// Steps the cap of each card down and up again while the user keeps it
+	// busy, and stores its dynamics per pci slot. Returns the exit code.
+	int autotune(AutotuneOptions const& o);
+
+	// What autotune found for the card, if it ever ran for it
+	std::optional<Dynamics> dynamics_of(std::string const& hwmon);
+}
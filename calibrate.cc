@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * The calibration is plain text, one line per model and cap:
+ *
+ * 0x73bf 150000000 1820
+ *
+ * The last field is the sclk in MHz sustained under load with that cap.
+ * Calibrating a model replaces all of its lines, so only the first card of
+ * each model gets calibrated. Lines we do not understand are dropped.
+ */
+
+#include "calibrate.hh"
+#include "config.hh"
+#include "expr.hh"
+#include "sysfs.hh"
+#include "trial.hh"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace powercap {
+
+	namespace {
+
+		// Give the SMU a moment to settle on the new cap
+		constexpr std::chrono::seconds settle_time{ 2 };
+		constexpr std::chrono::milliseconds sample_interval{ 250 };
+
+		struct Point {
+			std::string model;
+			std::uint64_t cap = 0;
+			unsigned mhz = 0;
+		};
+
+		std::vector<Point> load_calibration() {
+			std::vector<Point> result;
+			auto const content = read_file(calibration_file);
+			if (not content.has_value())
+				return result;
+			for_each_line(*content, [&result](std::string_view line) {
+				Point p;
+				p.model = std::string{ next_token(line) };
+				std::uint64_t mhz = 0;
+				if (p.model.empty() or not to_uint64(next_token(line), p.cap) or not to_uint64(next_token(line), mhz))
+					return;
+				p.mhz = static_cast<unsigned>(mhz);
+				result.push_back(std::move(p));
+			});
+			return result;
+		}
+
+		int save_calibration(std::vector<Point> const& points) {
+			std::string content;
+			for (auto const& p : points) {
+				char nums[64];
+				std::snprintf(nums, sizeof(nums), " %" PRIu64 " %u\n", p.cap, p.mhz);
+				content += p.model + nums;
+			}
+			return save_table(calibration_file, content);
+		}
+
+		// Average sclk of the loaded samples, nothing if the card was idle
+		std::optional<unsigned> measure(CardAttributes& attrs, unsigned seconds) {
+			std::this_thread::sleep_for(settle_time);
+			auto const end = std::chrono::steady_clock::now() + std::chrono::seconds{ seconds };
+			std::uint64_t sum = 0;
+			unsigned n = 0;
+			while (not interrupted and std::chrono::steady_clock::now() < end) {
+				std::this_thread::sleep_for(sample_interval);
+				if (attrs.sample(1u << Signal::Busy)[Signal::Busy] < loaded_busy_percent)
+					continue;
+				if (auto const mhz = attrs.sclk()) {
+					sum += *mhz;
+					++n;
+				}
+			}
+			if (n == 0)
+				return {};
+			return static_cast<unsigned>(sum / n);
+		}
+
+		// Returns the points of the card, nothing if it got interrupted
+		std::optional<std::vector<Point>> calibrate_card(std::string const& hwmon, std::string const& model,
+			CalibrateOptions const& o)
+		{
+			CardAttributes attrs{ hwmon };
+			auto const min = attrs.cap_min();
+			auto const max = attrs.cap_max();
+			auto const original = attrs.cap();
+			if (model.empty() or not min or not max or not original or *max < *min) {
+				std::fprintf(stderr, "%s does not allow to set a power-limit\n", hwmon.c_str());
+				return std::vector<Point>{};
+			}
+
+			CapTrial trial{ hwmon, *original, "Calibrating " + pci_slot_of(hwmon) + " (" + model + ")" };
+			if (not trial.claimed())
+				return std::vector<Point>{};
+			std::vector<Point> points;
+			auto const steps = std::max(o.steps, 2u);
+			for (unsigned i = 0; i < steps and not interrupted; ++i) {
+				auto const cap = std::max(*min, whole_watts(*min + (*max - *min) * i / (steps - 1)));
+				if (not points.empty() and points.back().cap == cap)
+					continue;
+				if (trial.set(cap) < 0)
+					break;
+				auto const mhz = measure(attrs, o.seconds);
+				if (not mhz.has_value()) {
+					std::fprintf(stderr, "%" PRIu64 "W: the card was not busy, skipped\n", cap / 1000000);
+					continue;
+				}
+				std::printf("%" PRIu64 "W: %uMHz\n", cap / 1000000, *mhz);
+				points.push_back(Point{ model, cap, *mhz });
+			}
+			if (interrupted)
+				return {};
+			return points;
+		}
+	}
+
+	int calibrate(CalibrateOptions const& o) {
+		auto const hwmons = o.device
+			? std::vector<std::string>{ find_hwmon_base_path_for_device(o.device) }
+			: find_all_hwmon_base_paths();
+		if (hwmons.empty() or hwmons.front().empty()) {
+			std::fprintf(stderr, "Unable to find gpu\n");
+			return 1;
+		}
+
+		catch_interrupts();
+
+		auto all = load_calibration();
+		// The first card of a model speaks for all of them
+		std::vector<std::string> models;
+		for (auto const& hwmon : hwmons) {
+			auto const model = identify(hwmon).model;
+			if (std::find(models.begin(), models.end(), model) != models.end()) {
+				std::printf("Skipping %s, another %s got calibrated already\n", pci_slot_of(hwmon).c_str(),
+					model.c_str());
+				continue;
+			}
+			auto points = calibrate_card(hwmon, model, o);
+			if (not points.has_value()) {
+				std::fprintf(stderr, "Interrupted, nothing saved\n");
+				return 1;
+			}
+			if (points->empty())
+				continue;
+			models.push_back(model);
+			all.erase(std::remove_if(all.begin(), all.end(), [&model](Point const& p) { return p.model == model; }),
+				all.end());
+			all.insert(all.end(), points->begin(), points->end());
+		}
+		if (auto const err = save_calibration(all); err < 0) {
+			std::fprintf(stderr, "Could not write %s: %s\n", calibration_file, std::strerror(-err));
+			return 1;
+		}
+		return 0;
+	}
+
+	std::optional<std::uint64_t> cap_for_sclk(std::string const& hwmon, unsigned mhz) {
+		auto const model = identify(hwmon).model;
+		std::optional<std::uint64_t> best;
+		for (auto const& p : load_calibration())
+			if (p.model == model and p.mhz >= mhz and (not best or p.cap < *best))
+				best = p.cap;
+		if (not best)
+			return std::nullopt;
+
+		// Cards of the same model may come with different limits
+		CardAttributes attrs{ hwmon };
+		if (auto const max = attrs.cap_max(); max and *best > *max)
+			best = max;
+		if (auto const min = attrs.cap_min(); min and *best < *min)
+			best = min;
+		return best;
+	}
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace powercap {
+
+	constexpr char const* calibration_file = "/var/lib/powercap/calibration";
+
+	struct CalibrateOptions {
+		// Only calibrate this card, otherwise all of them
+		char const* device = nullptr;
+		// Number of caps tried between power1_cap_min and power1_cap_max
+		unsigned steps = 8;
+		// Time spent measuring each of them
+		unsigned seconds = 10;
+	};
+
+	// Steps through the caps of the cards while the user keeps them busy and
+	// records the sclk each sustains, per card model. Only the first card of
+	// each model is calibrated. Returns the exit code.
+	int calibrate(CalibrateOptions const& o);
+
+	// The lowest calibrated cap in uW under which the card sustained at
+	// least mhz, clamped to the limits of the card
+	std::optional<std::uint64_t> cap_for_sclk(std::string const& hwmon, unsigned mhz);
+}
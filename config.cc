@@ -0,0 +1,452 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * The config is ini-like, e.g:
+ *
+ * [profile quiet]
+ * cap = 180W            # min, max, default or a value in watts
+ *
+ * [profile cool]
+ * cap = clamp(max * (1 - (temp - 70) / 20), min, max)
+ *
+ * [card]
+ * model = 0x73bf        # and/or slot = 0000:03:00.0, index = 1
+ * profile = quiet
+ * schedule = 18:00-23:00 max
+ * policy = enforce      # or once
+ *
+ * [equalize]
+ * budget = 600W         # shared by the selected cards, takes the same
+ * tolerance = 25        # selectors as a card rule
+ *
+ * The profiles min, max and default always exist. Rules are tried in the
+ * order they are written, the first one matching a card is used.
+ */
+
+#include "config.hh"
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+#include "sysfs.hh"
+
+namespace powercap {
+
+	namespace {
+
+		std::string_view trim(std::string_view s) {
+			auto const start = s.find_first_not_of(" \t\r");
+			if (start == s.npos)
+				return {};
+			auto const end = s.find_last_not_of(" \t\r");
+			return s.substr(start, end - start + 1);
+		}
+
+		std::string to_lower(std::string_view s) {
+			std::string r{ s };
+			for (auto& c : r)
+				c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			return r;
+		}
+
+		std::optional<CapSpec> parse_cap(std::string_view v, std::string& error) {
+			if (v == "min")
+				return CapSpec{ CapSpec::Min, 0, nullptr };
+			if (v == "max")
+				return CapSpec{ CapSpec::Max, 0, nullptr };
+			if (v == "default")
+				return CapSpec{ CapSpec::Default, 0, nullptr };
+			auto watts = v;
+			if (not watts.empty() and (watts.back() == 'W' or watts.back() == 'w'))
+				watts.remove_suffix(1);
+			if (is_digits(watts) and watts.size() <= 6)
+				return CapSpec{ CapSpec::Watts, std::strtoull(std::string{ watts }.c_str(), nullptr, 10) * 1000000, nullptr };
+			// Anything else has to be an expression over the live signals
+			auto expr = Expression::compile(v, error);
+			if (not expr)
+				return {};
+			return CapSpec{ CapSpec::Expr, 0, std::move(expr) };
+		}
+
+		// HH:MM
+		std::optional<unsigned> parse_time(std::string_view v) {
+			if (v.size() != 5 or v[2] != ':' or not is_digits(v.substr(0, 2)) or not is_digits(v.substr(3)))
+				return {};
+			unsigned const h = (v[0] - '0') * 10 + (v[1] - '0');
+			unsigned const m = (v[3] - '0') * 10 + (v[4] - '0');
+			if (h > 24 or m > 59 or (h == 24 and m != 0))
+				return {};
+			return h * 60 + m;
+		}
+
+		// Profiles may be referenced before they are defined, so rules keep
+		// the names until the whole file is read.
+		struct RawSchedule {
+			unsigned from;
+			unsigned to;
+			std::string profile;
+		};
+
+		struct RawRule {
+			unsigned line = 0;
+			std::vector<Selector> selectors;
+			std::string profile;
+			std::vector<RawSchedule> schedules;
+			Policy policy = Policy::Enforce;
+		};
+
+		class Parser {
+		public:
+			explicit Parser(std::string const& path) : m_path{ path } {
+				m_table.profiles.push_back(Profile{ "min", CapSpec{ CapSpec::Min, 0, nullptr } });
+				m_table.profiles.push_back(Profile{ "max", CapSpec{ CapSpec::Max, 0, nullptr } });
+				m_table.profiles.push_back(Profile{ "default", CapSpec{ CapSpec::Default, 0, nullptr } });
+			}
+
+			bool parse(std::string_view content) {
+				while (not content.empty()) {
+					++m_line;
+					auto const nl = content.find('\n');
+					auto line = content.substr(0, nl);
+					content.remove_prefix(nl == content.npos ? content.size() : nl + 1);
+
+					if (auto const comment = line.find_first_of("#;"); comment != line.npos)
+						line = line.substr(0, comment);
+					line = trim(line);
+					if (line.empty())
+						continue;
+					if (not (line.front() == '[' ? parse_section(line) : parse_assignment(line)))
+						return false;
+				}
+				return finish_section() and compile();
+			}
+
+			std::shared_ptr<RuleTable const> table() {
+				return std::make_shared<RuleTable const>(std::move(m_table));
+			}
+
+			std::string const& error() const {
+				return m_error;
+			}
+
+		private:
+			enum class Section {
+				None,
+				Profile,
+				Card,
+				Equalize,
+			};
+
+			bool fail(std::string const& what, unsigned line = 0) {
+				m_error = m_path + ":" + std::to_string(line ? line : m_line) + ": " + what;
+				return false;
+			}
+
+			std::optional<std::size_t> find_profile(std::string_view name) const {
+				for (std::size_t i = 0; i < m_table.profiles.size(); ++i)
+					if (m_table.profiles[i].name == name)
+						return i;
+				return {};
+			}
+
+			bool finish_section() {
+				if (m_section == Section::Profile and not m_has_cap)
+					return fail("profile '" + m_table.profiles.back().name + "' has no cap", m_section_line);
+				if (m_section == Section::Card and m_rules.back().profile.empty())
+					return fail("card rule has no profile", m_section_line);
+				if (m_section == Section::Equalize and m_table.equalize->budget == 0)
+					return fail("equalize has no budget", m_section_line);
+				return true;
+			}
+
+			bool parse_section(std::string_view line) {
+				if (line.back() != ']')
+					return fail("unterminated section header");
+				if (not finish_section())
+					return false;
+				m_section_line = m_line;
+
+				auto const header = trim(line.substr(1, line.size() - 2));
+				if (header == "card") {
+					m_section = Section::Card;
+					m_rules.push_back(RawRule{});
+					m_rules.back().line = m_line;
+					return true;
+				}
+				if (header == "equalize") {
+					if (m_table.equalize)
+						return fail("equalize is already defined");
+					m_section = Section::Equalize;
+					m_table.equalize.emplace();
+					return true;
+				}
+				if (starts_with(header, "profile ")) {
+					auto const name = trim(header.substr(std::strlen("profile ")));
+					if (name.empty() or name.find_first_of(" \t") != name.npos)
+						return fail("invalid profile name");
+					if (find_profile(name))
+						return fail("profile '" + std::string{ name } + "' is already defined");
+					m_section = Section::Profile;
+					m_has_cap = false;
+					m_table.profiles.push_back(Profile{ std::string{ name }, {} });
+					return true;
+				}
+				return fail("unknown section '" + std::string{ header } + "'");
+			}
+
+			bool parse_assignment(std::string_view line) {
+				auto const eq = line.find('=');
+				if (eq == line.npos)
+					return fail("expected key = value");
+				auto const key = trim(line.substr(0, eq));
+				auto const value = trim(line.substr(eq + 1));
+				if (value.empty())
+					return fail("missing value for '" + std::string{ key } + "'");
+
+				switch (m_section) {
+				case Section::None:
+					return fail("'" + std::string{ key } + "' outside of a section");
+				case Section::Profile:
+					return parse_profile_key(key, value);
+				case Section::Card:
+					return parse_card_key(key, value);
+				case Section::Equalize:
+					return parse_equalize_key(key, value);
+				}
+				return false;
+			}
+
+			bool parse_profile_key(std::string_view key, std::string_view value) {
+				if (key != "cap")
+					return fail("unknown key '" + std::string{ key } + "'");
+				std::string error;
+				auto const cap = parse_cap(value, error);
+				if (not cap)
+					return fail(error);
+				m_table.profiles.back().cap = *cap;
+				m_has_cap = true;
+				return true;
+			}
+
+			// Returns nothing if key is no selector, false on an invalid one
+			std::optional<bool> parse_selector(std::string_view key, std::string_view value,
+				std::vector<Selector>& selectors)
+			{
+				if (key == "slot") {
+					selectors.push_back(Selector{ Selector::Slot, to_lower(value) });
+				} else if (key == "model") {
+					auto model = to_lower(value);
+					if (not starts_with(model, "0x"))
+						model = "0x" + model;
+					selectors.push_back(Selector{ Selector::Model, model });
+				} else if (key == "index") {
+					if (not is_digits(value))
+						return fail("invalid index '" + std::string{ value } + "'");
+					auto const index = std::strtoul(std::string{ value }.c_str(), nullptr, 10);
+					selectors.push_back(Selector{ Selector::Index, std::to_string(index) });
+				} else {
+					return {};
+				}
+				return true;
+			}
+
+			bool parse_equalize_key(std::string_view key, std::string_view value) {
+				auto& e = *m_table.equalize;
+				if (auto const selector = parse_selector(key, value, e.selectors))
+					return *selector;
+				if (key == "budget") {
+					std::string error;
+					auto const cap = parse_cap(value, error);
+					if (not cap or cap->kind != CapSpec::Watts or cap->uw == 0)
+						return fail("expected budget = watts");
+					e.budget = cap->uw;
+				} else if (key == "tolerance") {
+					if (not is_digits(value) or value.size() > 5)
+						return fail("invalid tolerance '" + std::string{ value } + "'");
+					e.tolerance = std::strtoul(std::string{ value }.c_str(), nullptr, 10);
+				} else {
+					return fail("unknown key '" + std::string{ key } + "'");
+				}
+				return true;
+			}
+
+			bool parse_card_key(std::string_view key, std::string_view value) {
+				auto& r = m_rules.back();
+				if (auto const selector = parse_selector(key, value, r.selectors)) {
+					return *selector;
+				} else if (key == "profile") {
+					r.profile = std::string{ value };
+				} else if (key == "schedule") {
+					auto const space = value.find_first_of(" \t");
+					auto const range = value.substr(0, space);
+					auto const dash = range.find('-');
+					auto const from = parse_time(range.substr(0, dash));
+					auto const to = dash == range.npos ? std::nullopt : parse_time(range.substr(dash + 1));
+					auto const profile = space == value.npos ? std::string_view{} : trim(value.substr(space));
+					if (not from or not to or profile.empty())
+						return fail("expected schedule = HH:MM-HH:MM profile");
+					r.schedules.push_back(RawSchedule{ *from, *to, std::string{ profile } });
+				} else if (key == "policy") {
+					if (value == "enforce")
+						r.policy = Policy::Enforce;
+					else if (value == "once")
+						r.policy = Policy::Once;
+					else
+						return fail("invalid policy '" + std::string{ value } + "'");
+				} else {
+					return fail("unknown key '" + std::string{ key } + "'");
+				}
+				return true;
+			}
+
+			bool compile() {
+				for (auto const& raw : m_rules) {
+					Rule r;
+					r.selectors = raw.selectors;
+					r.policy = raw.policy;
+					auto const profile = find_profile(raw.profile);
+					if (not profile)
+						return fail("unknown profile '" + raw.profile + "'", raw.line);
+					r.profile = *profile;
+					for (auto const& s : raw.schedules) {
+						auto const p = find_profile(s.profile);
+						if (not p)
+							return fail("unknown profile '" + s.profile + "'", raw.line);
+						r.schedules.push_back(Schedule{ s.from, s.to, *p });
+					}
+					m_table.rules.push_back(std::move(r));
+				}
+				return true;
+			}
+
+			std::string const& m_path;
+			RuleTable m_table;
+			std::vector<RawRule> m_rules;
+			Section m_section = Section::None;
+			unsigned m_line = 0;
+			unsigned m_section_line = 0;
+			bool m_has_cap = false;
+			std::string m_error;
+		};
+	}
+
+	bool matches(std::vector<Selector> const& selectors, CardIdentity const& id) {
+		return std::all_of(selectors.begin(), selectors.end(), [&id](Selector const& s) {
+			switch (s.kind) {
+			case Selector::Slot: return s.value == id.slot;
+			case Selector::Model: return s.value == id.model;
+			case Selector::Index: {
+				// Called for every card on every round, so no to_string()
+				char buf[16];
+				auto const r = std::to_chars(buf, buf + sizeof(buf), id.index);
+				return s.value == std::string_view{ buf, static_cast<std::size_t>(r.ptr - buf) };
+			}
+			}
+			return false;
+		});
+	}
+
+	Rule const* RuleTable::match(CardIdentity const& id) const {
+		for (auto const& r : rules)
+			if (matches(r.selectors, id))
+				return &r;
+		return nullptr;
+	}
+
+	Profile const& RuleTable::profile_for(Rule const& r, unsigned minute_of_day) const {
+		for (auto const& s : r.schedules) {
+			auto const active = s.from <= s.to
+				? (minute_of_day >= s.from and minute_of_day < s.to)
+				: (minute_of_day >= s.from or minute_of_day < s.to);
+			if (active)
+				return profiles[s.profile];
+		}
+		return profiles[r.profile];
+	}
+
+	std::shared_ptr<RuleTable const> load_config(std::string const& path, std::string& error) {
+		auto const content = read_file(path);
+		if (not content.has_value()) {
+			error = path + ": " + std::strerror(errno);
+			return nullptr;
+		}
+		Parser p{ path };
+		if (not p.parse(*content)) {
+			error = p.error();
+			return nullptr;
+		}
+		return p.table();
+	}
+
+	CardIdentity identify(std::string const& hwmon) {
+		CardIdentity id;
+		id.slot = pci_slot_of(hwmon);
+		id.model = to_lower(read_string_from(hwmon + "/device/device").value_or(""));
+		id.index = card_index_of(hwmon);
+		return id;
+	}
+
+	std::optional<std::uint64_t> resolve(CapSpec const& spec, CardAttributes& card) {
+		switch (spec.kind) {
+		case CapSpec::Default: return card.cap_default();
+		case CapSpec::Min: return card.cap_min();
+		case CapSpec::Max: return card.cap_max();
+		case CapSpec::Watts:
+		case CapSpec::Expr: break;
+		}
+		auto v = spec.uw;
+		if (spec.kind == CapSpec::Expr) {
+			// Whole watts, so small changes of the inputs do not turn into a
+			// write (and an SMU message) on every tick
+			auto const w = std::lround(spec.expr->evaluate(card.sample(spec.expr->uses())));
+			v = w > 0 ? static_cast<std::uint64_t>(w) * 1000000 : 0;
+		}
+		// The driver rejects anything out of range, rather clamp than fail
+		auto const min = card.cap_min();
+		auto const max = card.cap_max();
+		if (min and v < *min)
+			v = *min;
+		if (max and v > *max)
+			v = *max;
+		return v;
+	}
+
+	std::uint64_t equal_share(std::uint64_t budget, unsigned n) {
+		return n == 0 ? budget : whole_watts(budget / n);
+	}
+
+	std::optional<unsigned> check_equalize(Equalize const& e, std::vector<std::string> const& hwmons,
+		std::string& error)
+	{
+		std::vector<std::string> members;
+		for (auto const& hwmon : hwmons)
+			if (matches(e.selectors, identify(hwmon)))
+				members.push_back(hwmon);
+		auto const share = equal_share(e.budget, static_cast<unsigned>(members.size()));
+		for (auto const& hwmon : members) {
+			CardAttributes attrs{ hwmon };
+			if (auto const min = attrs.cap_min(); min and *min > share) {
+				error = "equalize budget of " + std::to_string(e.budget / 1000000) + "W is too small for "
+					+ std::to_string(members.size()) + " cards, " + pci_slot_of(hwmon) + " needs at least "
+					+ std::to_string(*min / 1000000) + "W";
+				return {};
+			}
+		}
+		return static_cast<unsigned>(members.size());
+	}
+
+	unsigned current_minute_of_day() {
+		auto const now = std::time(nullptr);
+		struct tm tm{};
+		::localtime_r(&now, &tm);
+		return static_cast<unsigned>(tm.tm_hour * 60 + tm.tm_min);
+	}
+}
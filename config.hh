@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "expr.hh"
+
+namespace powercap {
+
+	constexpr char const* default_config_path = "/etc/powercap.conf";
+
+	// A power-limit as written in the config, it is resolved against the
+	// limits (and for expressions the live signals) of the actual card when
+	// applied.
+	struct CapSpec {
+		enum Kind {
+			Default,
+			Min,
+			Max,
+			Watts,
+			Expr,
+		};
+		Kind kind = Min;
+		std::uint64_t uw = 0;
+		std::shared_ptr<Expression const> expr;
+	};
+
+	struct Profile {
+		std::string name;
+		CapSpec cap;
+	};
+
+	struct Selector {
+		enum Kind {
+			Slot,
+			Model,
+			Index,
+		};
+		Kind kind = Slot;
+		std::string value;
+	};
+
+	// Use another profile between two times of the day, given in minutes
+	// since midnight. The range may wrap around midnight.
+	struct Schedule {
+		unsigned from = 0;
+		unsigned to = 0;
+		std::size_t profile = 0;
+	};
+
+	enum class Policy {
+		// Restore the power-limit whenever someone else changes it
+		Enforce,
+		// Apply it, but leave it alone afterwards
+		Once,
+	};
+
+	struct Rule {
+		// All of them must match, none matches every card
+		std::vector<Selector> selectors;
+		std::size_t profile = 0;
+		std::vector<Schedule> schedules;
+		Policy policy = Policy::Enforce;
+	};
+
+	// What the selectors of a rule are matched against
+	struct CardIdentity {
+		std::string slot;
+		std::string model;
+		int index = -1;
+	};
+
+	// True if all selectors match, which is the case if there are none
+	bool matches(std::vector<Selector> const& selectors, CardIdentity const& id);
+
+	// Share a total budget between the selected cards, so that they run at
+	// the same clock. A card that is faster than the others gives some of
+	// its cap to the slowest one.
+	struct Equalize {
+		std::vector<Selector> selectors;
+		std::uint64_t budget = 0;
+		// Clocks closer than this (MHz) count as equal
+		unsigned tolerance = 25;
+	};
+
+	// The compiled config. It never changes once loaded, a reload builds a
+	// new table and replaces the old one as a whole.
+	struct RuleTable {
+		std::vector<Profile> profiles;
+		std::vector<Rule> rules;
+		// The cards it selects are left alone by the rules
+		std::optional<Equalize> equalize;
+
+		// The first rule matching the card, nullptr if none does
+		Rule const* match(CardIdentity const& id) const;
+
+		// The profile the rule asks for at the given minute of the day
+		Profile const& profile_for(Rule const& r, unsigned minute_of_day) const;
+	};
+
+	// Returns nullptr and a message pointing to the offending line if the
+	// config is invalid.
+	std::shared_ptr<RuleTable const> load_config(std::string const& path, std::string& error);
+
+	CardIdentity identify(std::string const& hwmon);
+
+	// The power-limit in uW the spec stands for on the given card
+	std::optional<std::uint64_t> resolve(CapSpec const& spec, CardAttributes& card);
+
+	// The equal share of the budget in uW for n cards, in whole watts
+	std::uint64_t equal_share(std::uint64_t budget, unsigned n);
+
+	// Equal shares below power1_cap_min of one of the selected cards would
+	// add up to more than the budget. Returns the number of cards selected
+	// among hwmons, or nothing and a message if they can not keep it.
+	std::optional<unsigned> check_equalize(Equalize const& e, std::vector<std::string> const& hwmons,
+		std::string& error);
+
+	unsigned current_minute_of_day();
+}
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * energy_file holds two copies of the counters. A checkpoint overwrites the
+ * older one and syncs it, so whatever happens meanwhile the other copy stays
+ * intact. When loading, the valid copy with the higher sequence number wins.
+ *
+ * The counters are integrated from the power samples of the watch rounds,
+ * each sample is taken to last until the next one.
+ */
+
+#include "energy.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		constexpr char const* energy_dir = "/var/lib/powercap";
+		constexpr char const* energy_metrics_tmp_file = "/run/powercap/energy.prom.tmp";
+
+		constexpr char magic[8] = { 'P', 'C', 'E', 'N', 'R', 'G', '0', '1' };
+		constexpr std::size_t max_cards = 16;
+		constexpr std::chrono::minutes checkpoint_interval{ 5 };
+
+		struct Entry {
+			char key[56];
+			std::uint64_t uj;
+		};
+
+		struct Block {
+			char magic[8];
+			std::uint64_t seq;
+			std::uint32_t count;
+			std::uint32_t crc;
+			std::uint8_t reserved[8];
+			Entry entries[max_cards];
+		};
+		static_assert(sizeof(Block) == 32 + max_cards * sizeof(Entry));
+
+		std::uint32_t crc32(void const* data, std::size_t size) {
+			auto const* p = static_cast<std::uint8_t const*>(data);
+			std::uint32_t crc = ~0u;
+			while (size-- > 0) {
+				crc ^= *p++;
+				for (int i = 0; i < 8; ++i)
+					crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+			}
+			return ~crc;
+		}
+
+		// Over the whole block, with crc itself taken as 0
+		std::uint32_t checksum(Block b) {
+			b.crc = 0;
+			return crc32(&b, sizeof(b));
+		}
+
+		bool is_valid(Block const& b) {
+			return std::memcmp(b.magic, magic, sizeof(magic)) == 0 and b.count <= max_cards
+				and b.crc == checksum(b);
+		}
+	}
+
+	EnergyCounters::EnergyCounters() {
+		int const fd = ::open(energy_file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		Block blocks[2];
+		Block const* newest = nullptr;
+		for (auto& b : blocks) {
+			auto const i = &b - blocks;
+			if (::pread(fd, &b, sizeof(b), i * sizeof(b)) != sizeof(b) or not is_valid(b))
+				continue;
+			if (newest == nullptr or b.seq > newest->seq)
+				newest = &b;
+		}
+		::close(fd);
+		if (newest == nullptr)
+			return;
+
+		m_seq = newest->seq;
+		for (std::uint32_t i = 0; i < newest->count; ++i) {
+			auto const& e = newest->entries[i];
+			Counter c;
+			c.key.assign(e.key, strnlen(e.key, sizeof(e.key)));
+			c.uj = e.uj;
+			m_counters.push_back(std::move(c));
+		}
+	}
+
+	std::size_t EnergyCounters::counter_for(std::string const& hwmon, std::string const& slot) {
+		auto key = slot;
+		if (auto const id = read_string_from(hwmon + "/device/unique_id"); id.has_value() and not id->empty())
+			key += "/" + *id;
+		key.resize(std::min(key.size(), sizeof(Entry::key) - 1));
+		for (std::size_t i = 0; i < m_counters.size(); ++i)
+			if (m_counters[i].key == key)
+				return i;
+		Counter c;
+		c.key = std::move(key);
+		m_counters.push_back(std::move(c));
+		return m_counters.size() - 1;
+	}
+
+	void EnergyCounters::add(std::size_t counter, double watts, clock::time_point now) {
+		auto& c = m_counters[counter];
+		if (c.last != clock::time_point{}) {
+			auto const dt = std::chrono::duration<double>(now - c.last).count();
+			c.uj += static_cast<std::uint64_t>(c.last_watts * dt * 1000000);
+		}
+		c.last = now;
+		c.last_watts = watts;
+	}
+
+	void EnergyCounters::pause(std::size_t counter) {
+		m_counters[counter].last = {};
+	}
+
+	void EnergyCounters::checkpoint(bool force) {
+		auto const now = clock::now();
+		if (m_counters.empty() or (not force and now - m_checkpointed < checkpoint_interval))
+			return;
+		m_checkpointed = now;
+
+		Block b{};
+		std::memcpy(b.magic, magic, sizeof(magic));
+		b.seq = ++m_seq;
+		for (auto const& c : m_counters) {
+			if (b.count == max_cards)
+				break;
+			auto& e = b.entries[b.count++];
+			std::memcpy(e.key, c.key.data(), c.key.size());
+			e.uj = c.uj;
+		}
+		b.crc = checksum(b);
+
+		if (::mkdir(energy_dir, 0755) < 0 and errno != EEXIST)
+			return;
+		if (int const fd = ::open(energy_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644); fd >= 0) {
+			auto const offset = static_cast<off_t>((b.seq % 2) * sizeof(b));
+			if (::pwrite(fd, &b, sizeof(b), offset) != sizeof(b) or ::fdatasync(fd) < 0)
+				std::fprintf(stderr, "Could not write %s: %s\n", energy_file, std::strerror(errno));
+			::close(fd);
+		}
+
+		// For the textfile collector of the prometheus node exporter
+		int const fd = ::open(energy_metrics_tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return;
+		::dprintf(fd, "# HELP powercap_energy_joules_total Energy used by the card\n"
+			"# TYPE powercap_energy_joules_total counter\n");
+		for (auto const& c : m_counters) {
+			auto const slash = c.key.find('/');
+			auto const slot_len = static_cast<int>(slash == c.key.npos ? c.key.size() : slash);
+			char const* id = slash == c.key.npos ? "" : c.key.c_str() + slash + 1;
+			::dprintf(fd, "powercap_energy_joules_total{slot=\"%.*s\",unique_id=\"%s\"} %" PRIu64 ".%06" PRIu64 "\n",
+				slot_len, c.key.c_str(), id, c.uj / 1000000, c.uj % 1000000);
+		}
+		::close(fd);
+		::rename(energy_metrics_tmp_file, energy_metrics_file);
+	}
+
+	void EnergyCounters::print() const {
+		for (auto const& c : m_counters)
+			std::printf("%s: %.1fkJ used in total\n", c.key.c_str(), c.uj / 1e9);
+	}
+}
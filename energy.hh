@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace powercap {
+
+	constexpr char const* energy_file = "/var/lib/powercap/energy";
+	constexpr char const* energy_metrics_file = "/run/powercap/energy.prom";
+
+	// Energy used per card since we first saw it, in uJ. The counters only
+	// ever grow, also across reboots and driver reloads, since they are
+	// checkpointed to energy_file.
+	class EnergyCounters {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		EnergyCounters();
+
+		// The counter of the card, created on first use. The key is the pci
+		// slot, followed by the unique_id of the gpu if it has one.
+		std::size_t counter_for(std::string const& hwmon, std::string const& slot);
+
+		// The card drew watts since its last sample
+		void add(std::size_t counter, double watts, clock::time_point now);
+
+		// The card went away, its next sample starts afresh instead of
+		// integrating the gap at the last wattage
+		void pause(std::size_t counter);
+
+		// Writes the counters to disk and the metrics file, but only every
+		// so often unless forced.
+		void checkpoint(bool force = false);
+
+		void print() const;
+
+	private:
+		struct Counter {
+			std::string key;
+			std::uint64_t uj = 0;
+			clock::time_point last;
+			double last_watts = 0;
+		};
+
+		std::vector<Counter> m_counters;
+		std::uint64_t m_seq = 0;
+		clock::time_point m_checkpointed = clock::now();
+	};
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * The hwmon readings of amdgpu are no measurements in the strict sense.
+ * power1_average is a moving average the SMU updates now and then, so it
+ * lags and comes in steps, power1_input is instantaneous but noisy, and
+ * the difference of two energy1_input readings is exact but only tells
+ * the average between them. A card offers some of them, the estimate
+ * weighs what is there by how much each can be trusted.
+ */
+
+#include "estimate.hh"
+
+#include <algorithm>
+#include <cmath>
+
+namespace powercap {
+
+	void PowerEstimate::predict(clock::time_point now) {
+		if (m_last != clock::time_point{} and now > m_last) {
+			auto const dt = std::chrono::duration<double>(now - m_last).count();
+			m_variance = std::min(m_variance + drift_per_second * dt, max_variance);
+		}
+		m_last = now;
+	}
+
+	void PowerEstimate::update(double watts, double variance) {
+		auto const gain = m_variance / (m_variance + variance);
+		m_watts += gain * (watts - m_watts);
+		m_variance *= 1 - gain;
+	}
+
+	double PowerEstimate::error() const {
+		return std::sqrt(m_variance);
+	}
+}
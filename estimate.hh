@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <chrono>
+
+namespace powercap {
+
+	// One power estimate per card out of readings of varying quality. It is
+	// a scalar Kalman filter: the uncertainty grows with the time since the
+	// last reading, and each reading pulls the estimate towards it, the
+	// harder the more precise it is compared to the estimate.
+	class PowerEstimate {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		// Lets the uncertainty grow up to now
+		void predict(clock::time_point now);
+
+		// A reading in W with its variance in W²
+		void update(double watts, double variance);
+
+		double watts() const {
+			return m_watts;
+		}
+
+		// One standard deviation in W, large until the first reading
+		double error() const;
+
+	private:
+		double m_watts = 0;
+		double m_variance = max_variance;
+		clock::time_point m_last{};
+
+		// The draw can change by hundreds of watts within a second
+		static constexpr double drift_per_second = 400;
+		static constexpr double max_variance = 1e6;
+	};
+}
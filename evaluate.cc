@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Replays recorded samples under other caps. What a card drew while it was
+ * not at its cap is what the workload asked for, its demand. Where it was
+ * at the cap the demand is unknown, we take what it drew, so a policy with
+ * higher caps is never credited with more than was seen. Under a cap the
+ * card draws the smaller of the two.
+ *
+ * Throughput is weighted by gpu_busy_percent, an idle card loses nothing,
+ * and taken to grow with the square root of the power: clocks scale about
+ * linearly with power at the low end and much worse at the high end. A
+ * violation is a sample close to temp1_crit in which the policy would have
+ * allowed more than the cap that was in place.
+ *
+ * The policies are min, max and default, each profile of the config, and
+ * the rules of the config as a whole, next to what was recorded. Every
+ * policy and card is a task of its own, spread over all cores.
+ */
+
+#include "evaluate.hh"
+#include "config.hh"
+#include "recorder.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace powercap {
+
+	namespace {
+
+		// A card's samples in order, and what we know about it
+		struct Trace {
+			std::string slot;
+			std::vector<Record> records;
+			CardIdentity id;
+			// In W, nothing if they are unknown
+			std::optional<double> min;
+			std::optional<double> max;
+			std::optional<double> fallback_default;
+		};
+
+		// A policy to replay the traces under
+		struct Candidate {
+			enum Kind {
+				Recorded,
+				Spec,
+				Rules,
+			};
+			Kind kind = Recorded;
+			std::string name;
+			CapSpec spec;
+		};
+
+		struct Score {
+			double joules = 0;
+			double demand_joules = 0;
+			// Busy weighted seconds, and how much of them got lost
+			double busy_seconds = 0;
+			double lost_seconds = 0;
+			unsigned writes = 0;
+			unsigned violations = 0;
+			// Traces the policy could not be applied to, for lack of limits
+			unsigned skipped = 0;
+		};
+
+		unsigned minute_of_day(std::int64_t ns) {
+			auto const t = static_cast<std::time_t>(ns / 1000000000);
+			struct tm tm{};
+			::localtime_r(&t, &tm);
+			return static_cast<unsigned>(tm.tm_hour * 60 + tm.tm_min);
+		}
+
+		// Like resolve(), but against the signals of a sample
+		std::optional<double> cap_for(CapSpec const& spec, Signals const& s, Trace const& t) {
+			double w = 0;
+			switch (spec.kind) {
+			case CapSpec::Default: return t.fallback_default;
+			case CapSpec::Min: return t.min;
+			case CapSpec::Max: return t.max;
+			case CapSpec::Watts: w = static_cast<double>(spec.uw) / 1e6; break;
+			case CapSpec::Expr:
+				if (not t.min or not t.max or not t.fallback_default)
+					return {};
+				w = std::max<double>(std::lround(spec.expr->evaluate(s)), 0);
+				break;
+			}
+			if (t.min)
+				w = std::max(w, *t.min);
+			if (t.max)
+				w = std::min(w, *t.max);
+			return w;
+		}
+
+		Score replay(Candidate const& p, Trace const& t, RuleTable const* rules) {
+			Score score;
+			std::optional<double> last_cap;
+			double granted = 0;
+			for (std::size_t i = 0; i < t.records.size(); ++i) {
+				auto const& r = t.records[i];
+				double const recorded_cap = static_cast<double>(r.cap) / 1e6;
+				double const demand = r.power / 1000.0;
+
+				Signals s{};
+				s[Signal::Temp] = r.temp / 1000.0;
+				s[Signal::Busy] = r.busy;
+				s[Signal::Power] = i == 0 ? demand : granted;
+				s[Signal::Ac] = 1;
+				s[Signal::CapMin] = t.min.value_or(0);
+				s[Signal::CapMax] = t.max.value_or(0);
+				s[Signal::CapDefault] = t.fallback_default.value_or(0);
+				s[Signal::Hour] = minute_of_day(r.time_ns) / 60.0;
+
+				std::optional<double> cap = recorded_cap;
+				if (p.kind == Candidate::Spec) {
+					cap = cap_for(p.spec, s, t);
+				} else if (p.kind == Candidate::Rules) {
+					// Cards no rule matches keep what they had, and so do the
+					// equalized ones, their caps depend on the other cards
+					auto const* rule = rules->match(t.id);
+					bool const equalized = rules->equalize and matches(rules->equalize->selectors, t.id);
+					if (rule != nullptr and not equalized)
+						cap = cap_for(rules->profile_for(*rule, minute_of_day(r.time_ns)).cap, s, t);
+				}
+				if (not cap.has_value()) {
+					Score skipped;
+					skipped.skipped = 1;
+					return skipped;
+				}
+				if (last_cap and std::abs(*last_cap - *cap) >= 0.5)
+					++score.writes;
+				last_cap = cap;
+				// No cap recorded means the card ran at whatever it liked
+				granted = recorded_cap > 0 or p.kind != Candidate::Recorded ? std::min(demand, *cap) : demand;
+				if ((r.events & Thermal) and *cap > recorded_cap + 0.5)
+					++score.violations;
+
+				if (i + 1 == t.records.size() or t.records[i + 1].time_ns - r.time_ns > max_gap_ns)
+					continue;
+				auto const dt = (t.records[i + 1].time_ns - r.time_ns) / 1e9;
+				score.joules += granted * dt;
+				score.demand_joules += demand * dt;
+				auto const busy = r.busy / 100.0 * dt;
+				score.busy_seconds += busy;
+				if (demand > 0)
+					score.lost_seconds += busy * (1 - std::sqrt(granted / demand));
+			}
+			return score;
+		}
+
+		// Directories stand for the recordings in them
+		int collect(char const* path, std::vector<std::string>& files) {
+			struct stat st;
+			if (::stat(path, &st) < 0)
+				return -errno;
+			if (not S_ISDIR(st.st_mode)) {
+				files.emplace_back(path);
+				return 0;
+			}
+			DIR* dir = ::opendir(path);
+			if (dir == nullptr)
+				return -errno;
+			std::vector<std::string> found;
+			while (auto const* dir_entry = ::readdir(dir)) {
+				std::string_view const name{ dir_entry->d_name };
+				if (name.size() > 4 and name.substr(name.size() - 4) == ".rec")
+					found.push_back(std::string{ path } + "/" + dir_entry->d_name);
+			}
+			::closedir(dir);
+			std::sort(found.begin(), found.end());
+			files.insert(files.end(), found.begin(), found.end());
+			return 0;
+		}
+
+		// Ordered per card, without the duplicates of overlapping dumps
+		std::vector<Trace> split(std::vector<Record>& records, EvaluateOptions const& o) {
+			merge_records(records);
+
+			std::vector<Trace> result;
+			for (auto const& r : records) {
+				std::string_view const slot{ r.slot, strnlen(r.slot, sizeof(r.slot)) };
+				if (result.empty() or result.back().slot != slot) {
+					result.emplace_back();
+					result.back().slot = std::string{ slot };
+				}
+				result.back().records.push_back(r);
+			}
+
+			// The limits of the card, if it is still around
+			for (auto& t : result) {
+				t.id.slot = t.slot;
+				t.min = o.min;
+				t.max = o.max;
+				t.fallback_default = o.fallback_default;
+				auto const hwmon = find_hwmon_base_path_for_device("/sys/bus/pci/devices/" + t.slot);
+				if (hwmon.empty())
+					continue;
+				t.id = identify(hwmon);
+				CardAttributes attrs{ hwmon };
+				auto const watts = [](std::optional<std::uint64_t> uw) -> std::optional<double> {
+					if (not uw.has_value())
+						return {};
+					return static_cast<double>(*uw) / 1e6;
+				};
+				if (auto const v = watts(attrs.cap_min()))
+					t.min = v;
+				if (auto const v = watts(attrs.cap_max()))
+					t.max = v;
+				if (auto const v = watts(attrs.cap_default()))
+					t.fallback_default = v;
+			}
+			return result;
+		}
+
+		void print_table(std::vector<Candidate> const& policies, std::vector<Score> const& scores) {
+			std::printf("%-20s %8s %8s %8s %10s %7s\n", "policy", "kWh", "saved", "lost", "cap writes", "thermal");
+			for (std::size_t i = 0; i < policies.size(); ++i) {
+				auto const& s = scores[i];
+				std::printf("%-20s %8.3f %7.1f%% %7.1f%% %10u %7u", policies[i].name.c_str(), s.joules / 3.6e6,
+					s.demand_joules > 0 ? 100 * (1 - s.joules / s.demand_joules) : 0,
+					s.busy_seconds > 0 ? 100 * s.lost_seconds / s.busy_seconds : 0, s.writes, s.violations);
+				if (s.skipped > 0)
+					std::printf("  (%u cards without limits skipped)", s.skipped);
+				std::printf("\n");
+			}
+		}
+
+		void print_json(std::vector<Candidate> const& policies, std::vector<Score> const& scores) {
+			std::printf("{\"policies\":[");
+			for (std::size_t i = 0; i < policies.size(); ++i) {
+				auto const& s = scores[i];
+				std::printf("%s{\"policy\":\"%s\",\"energy_kwh\":%.6f,\"energy_saved\":%.4f,\"throughput_lost\":%.4f,"
+					"\"cap_writes\":%u,\"thermal_violations\":%u,\"skipped_cards\":%u}",
+					i > 0 ? "," : "", policies[i].name.c_str(), s.joules / 3.6e6,
+					s.demand_joules > 0 ? 1 - s.joules / s.demand_joules : 0,
+					s.busy_seconds > 0 ? s.lost_seconds / s.busy_seconds : 0, s.writes, s.violations, s.skipped);
+			}
+			std::printf("]}\n");
+		}
+	}
+
+	int evaluate(EvaluateOptions const& o) {
+		std::shared_ptr<RuleTable const> rules;
+		if (o.config != nullptr) {
+			std::string error;
+			rules = load_config(o.config, error);
+			if (not rules) {
+				std::fprintf(stderr, "%s\n", error.c_str());
+				return 1;
+			}
+		}
+
+		auto paths = o.paths;
+		if (paths.empty())
+			paths.push_back(recorder_dir);
+		std::vector<std::string> files;
+		for (auto const* p : paths) {
+			if (auto const err = collect(p, files); err < 0) {
+				std::fprintf(stderr, "Could not read %s: %s\n", p, std::strerror(-err));
+				return 1;
+			}
+		}
+		std::vector<Record> records;
+		for (auto const& f : files) {
+			if (auto const err = load_records(f.c_str(), records); err < 0) {
+				std::fprintf(stderr, "Could not read %s: %s\n", f.c_str(),
+					err == -EINVAL ? "not a recording" : std::strerror(-err));
+				return 1;
+			}
+		}
+		auto const traces = split(records, o);
+		if (traces.empty()) {
+			std::fprintf(stderr, "Nothing recorded\n");
+			return 1;
+		}
+
+		std::vector<Candidate> policies = {
+			{ Candidate::Recorded, "recorded", {} },
+			{ Candidate::Spec, "min", CapSpec{ CapSpec::Min, 0, nullptr } },
+			{ Candidate::Spec, "max", CapSpec{ CapSpec::Max, 0, nullptr } },
+			{ Candidate::Spec, "default", CapSpec{ CapSpec::Default, 0, nullptr } },
+		};
+		if (rules) {
+			// The first three profiles are the built-in ones
+			for (std::size_t i = 3; i < rules->profiles.size(); ++i)
+				policies.push_back(Candidate{ Candidate::Spec, "profile " + rules->profiles[i].name, rules->profiles[i].cap });
+			policies.push_back(Candidate{ Candidate::Rules, "rules", {} });
+		}
+
+		// One task per policy and card, each writes only its own score
+		std::vector<Score> partial(policies.size() * traces.size());
+		std::atomic<std::size_t> next{ 0 };
+		auto const work = [&] {
+			for (std::size_t i; (i = next++) < partial.size(); )
+				partial[i] = replay(policies[i / traces.size()], traces[i % traces.size()], rules.get());
+		};
+		std::vector<std::thread> workers;
+		auto const n = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), partial.size());
+		for (std::size_t i = 1; i < n; ++i)
+			workers.emplace_back(work);
+		work();
+		for (auto& w : workers)
+			w.join();
+
+		std::vector<Score> scores(policies.size());
+		for (std::size_t i = 0; i < partial.size(); ++i) {
+			auto& s = scores[i / traces.size()];
+			auto const& p = partial[i];
+			s.joules += p.joules;
+			s.demand_joules += p.demand_joules;
+			s.busy_seconds += p.busy_seconds;
+			s.lost_seconds += p.lost_seconds;
+			s.writes += p.writes;
+			s.violations += p.violations;
+			s.skipped += p.skipped;
+		}
+		if (o.json)
+			print_json(policies, scores);
+		else
+			print_table(policies, scores);
+		return 0;
+	}
+}
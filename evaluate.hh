@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <optional>
+#include <vector>
+
+namespace powercap {
+
+	struct EvaluateOptions {
+		// Recordings, or directories holding them, by default the ring and
+		// the dumps of the recorder
+		std::vector<char const*> paths;
+		// Also evaluate the rules and profiles of this config
+		char const* config = nullptr;
+		// Card limits in W for traces of cards not present here
+		std::optional<double> min;
+		std::optional<double> max;
+		std::optional<double> fallback_default;
+		bool json = false;
+	};
+
+	// Replays the recorded samples under each policy and reports what it
+	// would have saved and cost, returns the exit code
+	int evaluate(EvaluateOptions const& o);
+}
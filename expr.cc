@@ -0,0 +1,590 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Grammar, lowest precedence first:
+ *
+ * expr    := and ( ("or" | "||") and )*
+ * and     := cmp ( ("and" | "&&") cmp )*
+ * cmp     := add ( ("<" | "<=" | ">" | ">=" | "==" | "!=") add )?
+ * add     := mul ( ("+" | "-") mul )*
+ * mul     := unary ( ("*" | "/") unary )*
+ * unary   := ("-" | "not" | "!") unary | primary
+ * primary := number | signal | function "(" expr ("," expr)* ")" | "(" expr ")"
+ *
+ * Functions are min(a, b), max(a, b), clamp(x, lo, hi) and if(c, a, b).
+ * min and max without parentheses are the limits of the card.
+ *
+ * The parser emits postfix code right away. Whenever all operands of an
+ * operation are constants it is evaluated on the spot, so "max * 0.8"
+ * stays two loads and a multiply while "(1 - 0.2)" becomes 0.8.
+ */
+
+#include "expr.hh"
+
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+
+#include <dirent.h>
+
+namespace powercap {
+
+	namespace {
+
+		struct SignalName {
+			std::string_view name;
+			Signal signal;
+		};
+
+		constexpr std::array<SignalName, SignalCount> signal_names = {{
+			{ "temp", Signal::Temp },
+			{ "busy", Signal::Busy },
+			{ "power", Signal::Power },
+			{ "ac", Signal::Ac },
+			{ "min", Signal::CapMin },
+			{ "max", Signal::CapMax },
+			{ "default", Signal::CapDefault },
+			{ "hour", Signal::Hour },
+		}};
+
+		// Variances (W²) of the power readings: the energy counter is exact
+		// over the interval, power1_input is noisy, power1_average lags.
+		constexpr double energy_variance = 1;
+		constexpr double input_variance = 25;
+		constexpr double average_variance = 100;
+
+		// 1 if any mains supply is online, or if there is no mains supply
+		// at all (a desktop without UPS reporting). The supplies are looked
+		// up once, afterwards this is a pread per supply.
+		double read_ac_online() {
+			static std::vector<Attribute> mains = [] {
+				std::vector<Attribute> result;
+				DIR* dir = ::opendir("/sys/class/power_supply");
+				if (dir == nullptr)
+					return result;
+				while (auto const* dir_entry = ::readdir(dir)) {
+					if (dir_entry->d_name[0] == '.')
+						continue;
+					std::string const base{ std::string{ "/sys/class/power_supply/" } + dir_entry->d_name };
+					if (read_string_from(base + "/type").value_or("") == "Mains")
+						result.emplace_back(base + "/online");
+				}
+				::closedir(dir);
+				return result;
+			}();
+
+			if (mains.empty())
+				return 1;
+			for (auto& m : mains)
+				if (m.read_uint64().value_or(0) == 1)
+					return 1;
+			return 0;
+		}
+	}
+
+	class ExpressionCompiler {
+	public:
+		using Code = Expression::Code;
+
+		explicit ExpressionCompiler(std::string_view src) : m_src{ src } {}
+
+		std::shared_ptr<Expression const> compile(std::string& error) {
+			auto e = std::make_shared<Expression>();
+			m_expr = e.get();
+			if (parse_or() and expect_end() and m_max_depth <= Expression::max_depth)
+				return e;
+			if (m_error.empty())
+				m_error = "expression too complex";
+			error = "invalid expression '" + std::string{ m_src } + "': " + m_error;
+			return nullptr;
+		}
+
+	private:
+		// Bounds the recursion of the parser, which would otherwise
+		// overflow the stack on thousands of nested '-' or '('.
+		static constexpr std::size_t max_nesting = 256;
+
+		struct Nesting {
+			explicit Nesting(std::size_t& n) : m_n{ ++n } {}
+			~Nesting() { --m_n; }
+			std::size_t& m_n;
+		};
+
+		bool fail(std::string what) {
+			if (m_error.empty())
+				m_error = std::move(what);
+			return false;
+		}
+
+		void skip_space() {
+			while (m_pos < m_src.size() and std::isspace(static_cast<unsigned char>(m_src[m_pos])))
+				++m_pos;
+		}
+
+		bool accept(std::string_view token) {
+			skip_space();
+			if (m_src.substr(m_pos, token.size()) != token)
+				return false;
+			// Keywords must not be the start of a longer identifier
+			auto const end = m_pos + token.size();
+			if (std::isalpha(static_cast<unsigned char>(token.back())) and end < m_src.size()
+				and (std::isalnum(static_cast<unsigned char>(m_src[end])) or m_src[end] == '_'))
+				return false;
+			m_pos = end;
+			return true;
+		}
+
+		bool expect(std::string_view token) {
+			if (accept(token))
+				return true;
+			return fail("expected '" + std::string{ token } + "'");
+		}
+
+		bool expect_end() {
+			skip_space();
+			if (m_pos == m_src.size())
+				return true;
+			return fail("unexpected '" + std::string{ m_src.substr(m_pos) } + "'");
+		}
+
+		static double apply(Code code, double const* a) {
+			switch (code) {
+			case Code::Const:
+			case Code::Load: break;
+			case Code::Neg: return -a[0];
+			case Code::Not: return a[0] == 0 ? 1 : 0;
+			case Code::Add: return a[0] + a[1];
+			case Code::Sub: return a[0] - a[1];
+			case Code::Mul: return a[0] * a[1];
+			case Code::Div: return a[1] == 0 ? 0 : a[0] / a[1];
+			case Code::Lt: return a[0] < a[1];
+			case Code::Le: return a[0] <= a[1];
+			case Code::Gt: return a[0] > a[1];
+			case Code::Ge: return a[0] >= a[1];
+			case Code::Eq: return a[0] == a[1];
+			case Code::Ne: return a[0] != a[1];
+			case Code::And: return a[0] != 0 and a[1] != 0;
+			case Code::Or: return a[0] != 0 or a[1] != 0;
+			case Code::Min: return a[0] < a[1] ? a[0] : a[1];
+			case Code::Max: return a[0] > a[1] ? a[0] : a[1];
+			case Code::Clamp: return a[0] < a[1] ? a[1] : (a[0] > a[2] ? a[2] : a[0]);
+			case Code::If: return a[0] != 0 ? a[1] : a[2];
+			}
+			return 0;
+		}
+
+		void push(Code code, double value) {
+			m_expr->m_code.push_back(Expression::Op{ code, value });
+			if (++m_depth > m_max_depth)
+				m_max_depth = m_depth;
+		}
+
+		// Emit an operation taking arity values from the stack, or fold it
+		// into a constant if all of them are known already.
+		void emit(Code code, std::size_t arity) {
+			auto& c = m_expr->m_code;
+			bool constant = c.size() >= arity;
+			for (std::size_t i = c.size() - arity; constant and i < c.size(); ++i)
+				constant = c[i].code == Code::Const;
+			m_depth -= arity - 1;
+			if (not constant) {
+				c.push_back(Expression::Op{ code, 0 });
+				return;
+			}
+			double args[3];
+			for (std::size_t i = 0; i < arity; ++i)
+				args[i] = c[c.size() - arity + i].value;
+			c.resize(c.size() - arity);
+			c.push_back(Expression::Op{ Code::Const, apply(code, args) });
+		}
+
+		bool parse_or() {
+			if (not parse_and())
+				return false;
+			while (accept("or") or accept("||")) {
+				if (not parse_and())
+					return false;
+				emit(Code::Or, 2);
+			}
+			return true;
+		}
+
+		bool parse_and() {
+			if (not parse_cmp())
+				return false;
+			while (accept("and") or accept("&&")) {
+				if (not parse_cmp())
+					return false;
+				emit(Code::And, 2);
+			}
+			return true;
+		}
+
+		bool parse_cmp() {
+			if (not parse_add())
+				return false;
+			// Two character operators first
+			static constexpr std::array<std::pair<std::string_view, Code>, 6> ops = {{
+				{ "<=", Code::Le },
+				{ ">=", Code::Ge },
+				{ "==", Code::Eq },
+				{ "!=", Code::Ne },
+				{ "<", Code::Lt },
+				{ ">", Code::Gt },
+			}};
+			for (auto const& [token, code] : ops) {
+				if (not accept(token))
+					continue;
+				if (not parse_add())
+					return false;
+				emit(code, 2);
+				break;
+			}
+			return true;
+		}
+
+		bool parse_add() {
+			if (not parse_mul())
+				return false;
+			for (;;) {
+				Code code;
+				if (accept("+"))
+					code = Code::Add;
+				else if (accept("-"))
+					code = Code::Sub;
+				else
+					return true;
+				if (not parse_mul())
+					return false;
+				emit(code, 2);
+			}
+		}
+
+		bool parse_mul() {
+			if (not parse_unary())
+				return false;
+			for (;;) {
+				Code code;
+				if (accept("*"))
+					code = Code::Mul;
+				else if (accept("/"))
+					code = Code::Div;
+				else
+					return true;
+				if (not parse_unary())
+					return false;
+				emit(code, 2);
+			}
+		}
+
+		bool parse_unary() {
+			Nesting const nesting{ m_nesting };
+			if (m_nesting > max_nesting)
+				return fail("expression too complex");
+			Code code;
+			if (accept("-"))
+				code = Code::Neg;
+			else if (accept("not") or accept("!"))
+				code = Code::Not;
+			else
+				return parse_primary();
+			if (not parse_unary())
+				return false;
+			emit(code, 1);
+			return true;
+		}
+
+		bool parse_call(Code code, std::size_t arity) {
+			for (std::size_t i = 0; i < arity; ++i) {
+				if (i > 0 and not expect(","))
+					return false;
+				if (not parse_or())
+					return false;
+			}
+			if (not expect(")"))
+				return false;
+			emit(code, arity);
+			return true;
+		}
+
+		bool parse_primary() {
+			Nesting const nesting{ m_nesting };
+			if (m_nesting > max_nesting)
+				return fail("expression too complex");
+			skip_space();
+			if (accept("("))
+				return parse_or() and expect(")");
+			if (m_pos >= m_src.size())
+				return fail("unexpected end");
+
+			auto const start = m_src.data() + m_pos;
+			if (std::isdigit(static_cast<unsigned char>(*start)) or *start == '.') {
+				std::string const rest{ m_src.substr(m_pos) };
+				char* end = nullptr;
+				auto const v = std::strtod(rest.c_str(), &end);
+				m_pos += static_cast<std::size_t>(end - rest.c_str());
+				push(Code::Const, v);
+				return true;
+			}
+
+			auto const begin = m_pos;
+			while (m_pos < m_src.size() and (std::isalnum(static_cast<unsigned char>(m_src[m_pos])) or m_src[m_pos] == '_'))
+				++m_pos;
+			auto const name = m_src.substr(begin, m_pos - begin);
+			if (name.empty())
+				return fail("unexpected '" + std::string{ m_src.substr(begin) } + "'");
+
+			if (accept("(")) {
+				if (name == "min")
+					return parse_call(Code::Min, 2);
+				if (name == "max")
+					return parse_call(Code::Max, 2);
+				if (name == "clamp")
+					return parse_call(Code::Clamp, 3);
+				if (name == "if")
+					return parse_call(Code::If, 3);
+				return fail("unknown function '" + std::string{ name } + "'");
+			}
+			for (auto const& s : signal_names) {
+				if (s.name != name)
+					continue;
+				push(Code::Load, s.signal);
+				m_expr->m_uses |= 1u << s.signal;
+				return true;
+			}
+			return fail("unknown signal '" + std::string{ name } + "'");
+		}
+
+		friend class Expression;
+
+		std::string_view m_src;
+		std::size_t m_pos = 0;
+		Expression* m_expr = nullptr;
+		std::size_t m_depth = 0;
+		std::size_t m_max_depth = 0;
+		std::size_t m_nesting = 0;
+		std::string m_error;
+	};
+
+	std::shared_ptr<Expression const> Expression::compile(std::string_view src, std::string& error) {
+		return ExpressionCompiler{ src }.compile(error);
+	}
+
+	double Expression::evaluate(Signals const& s) const {
+		std::array<double, max_depth> stack;
+		std::size_t sp = 0;
+		for (auto const& op : m_code) {
+			switch (op.code) {
+			case Code::Const:
+				stack[sp++] = op.value;
+				break;
+			case Code::Load:
+				stack[sp++] = s[static_cast<std::size_t>(op.value)];
+				break;
+			case Code::Neg:
+			case Code::Not:
+				stack[sp - 1] = ExpressionCompiler::apply(op.code, &stack[sp - 1]);
+				break;
+			case Code::Clamp:
+			case Code::If:
+				sp -= 2;
+				stack[sp - 1] = ExpressionCompiler::apply(op.code, &stack[sp - 1]);
+				break;
+			default:
+				sp -= 1;
+				stack[sp - 1] = ExpressionCompiler::apply(op.code, &stack[sp - 1]);
+				break;
+			}
+		}
+		return sp == 1 ? stack[0] : 0;
+	}
+
+	CardAttributes::CardAttributes(std::string hwmon)
+		: m_hwmon{ std::move(hwmon) }
+		, m_cap{ m_hwmon + "/power1_cap" }
+		, m_cap_min{ m_hwmon + "/power1_cap_min" }
+		, m_cap_max{ m_hwmon + "/power1_cap_max" }
+		, m_cap_default{ m_hwmon + "/power1_cap_default" }
+		, m_temp{ m_hwmon + "/temp1_input" }
+		, m_busy{ m_hwmon + "/device/gpu_busy_percent" }
+		, m_power_average{ m_hwmon + "/power1_average" }
+		, m_power_input{ m_hwmon + "/power1_input" }
+		, m_energy{ m_hwmon + "/energy1_input" }
+		, m_runtime_status{ m_hwmon + "/device/power/runtime_status" }
+		, m_sclk{ m_hwmon + "/device/pp_dpm_sclk" }
+	{}
+
+	void CardAttributes::next_round() {
+		++m_round;
+	}
+
+	void CardAttributes::count_read() {
+		auto const now = std::chrono::steady_clock::now();
+		if (now - m_window >= std::chrono::minutes{ 1 }) {
+			m_window = now;
+			m_window_reads = 0;
+		}
+		++m_window_reads;
+		++m_reads;
+	}
+
+	std::optional<std::uint64_t> CardAttributes::read(Cached& c, bool fetch) {
+		if (not fetch or (m_round != 0 and c.round == m_round))
+			return c.value;
+		c.value = c.attribute.read_uint64();
+		c.round = m_round;
+		count_read();
+		return c.value;
+	}
+
+	std::optional<std::uint64_t> CardAttributes::cap() {
+		return read(m_cap);
+	}
+
+	std::optional<std::uint64_t> CardAttributes::cap_min() {
+		return read(m_cap_min);
+	}
+
+	std::optional<std::uint64_t> CardAttributes::cap_max() {
+		return read(m_cap_max);
+	}
+
+	std::optional<std::uint64_t> CardAttributes::cap_default() {
+		return read(m_cap_default);
+	}
+
+	int CardAttributes::set_cap(std::uint64_t uw) {
+		auto const err = set_power_cap(m_hwmon, uw);
+		if (err == 0) {
+			m_cap.value = uw;
+			m_cap.round = m_round;
+		}
+		return err;
+	}
+
+	std::optional<std::uint64_t> CardAttributes::temp_crit() {
+		if (not m_temp_crit_read) {
+			m_temp_crit = read_dec_uint64_value_from(m_hwmon + "/temp1_crit");
+			m_temp_crit_read = true;
+		}
+		return m_temp_crit;
+	}
+
+	// The current level is marked, e.g. "1: 1800Mhz *"
+	std::optional<unsigned> CardAttributes::sclk() {
+		if (m_round != 0 and m_sclk_round == m_round)
+			return m_sclk_value;
+		m_sclk_round = m_round;
+		m_sclk_value.reset();
+		count_read();
+		char buf[512];
+		auto levels = m_sclk.read(buf, sizeof(buf));
+		if (not levels.has_value())
+			return {};
+		while (not levels->empty()) {
+			auto const eol = levels->find('\n');
+			auto const line = levels->substr(0, eol);
+			levels->remove_prefix(eol == levels->npos ? levels->size() : eol + 1);
+			auto const colon = line.find(':');
+			if (line.find('*') == line.npos or colon == line.npos)
+				continue;
+			auto digits = line.substr(colon + 1);
+			while (not digits.empty() and digits.front() == ' ')
+				digits.remove_prefix(1);
+			unsigned mhz = 0;
+			for (; not digits.empty() and digits.front() >= '0' and digits.front() <= '9'; digits.remove_prefix(1))
+				mhz = mhz * 10 + static_cast<unsigned>(digits.front() - '0');
+			m_sclk_value = mhz;
+			return mhz;
+		}
+		return {};
+	}
+
+	// runtime_status is kept by the kernel, it does not reach the device
+	bool CardAttributes::is_suspended() {
+		if (m_round != 0 and m_suspended_round == m_round)
+			return m_suspended;
+		auto const s = m_runtime_status.read_line();
+		m_suspended = s.has_value() and *s != "active";
+		m_suspended_round = m_round;
+		return m_suspended;
+	}
+
+	std::optional<std::uint64_t> CardAttributes::read_source(Cached& c) {
+		if (c.missing)
+			return {};
+		auto const v = read(c);
+		if (v.has_value())
+			c.seen = true;
+		else if (not c.seen)
+			c.missing = true;
+		return v;
+	}
+
+	// Newer kernels only offer power1_input on some boards, older ones only
+	// power1_average, a reading of 0 means the SMU has none yet.
+	double CardAttributes::power(bool fetch) {
+		if (not fetch or (m_round != 0 and m_power_round == m_round))
+			return m_power.watts();
+		m_power_round = m_round;
+
+		auto const now = std::chrono::steady_clock::now();
+		m_power.predict(now);
+		if (auto const uj = read_source(m_energy)) {
+			if (m_last_uj.has_value() and *uj > *m_last_uj and now > m_last_uj_at) {
+				auto const dt = std::chrono::duration<double>(now - m_last_uj_at).count();
+				m_power.update(static_cast<double>(*uj - *m_last_uj) / 1e6 / dt, energy_variance);
+			}
+			m_last_uj = uj;
+			m_last_uj_at = now;
+		}
+		if (auto const uw = read_source(m_power_input); uw.value_or(0) > 0)
+			m_power.update(static_cast<double>(*uw) / 1e6, input_variance);
+		if (auto const uw = read_source(m_power_average); uw.value_or(0) > 0)
+			m_power.update(static_cast<double>(*uw) / 1e6, average_variance);
+		return m_power.watts();
+	}
+
+	Signals CardAttributes::sample(std::uint32_t mask) {
+		return sample(mask, true);
+	}
+
+	Signals CardAttributes::monitor(std::uint32_t mask) {
+		if (m_budget == 0)
+			return sample(mask, true);
+		auto const now = std::chrono::steady_clock::now();
+		bool const fetch = now - m_window >= std::chrono::minutes{ 1 } or m_window_reads < m_budget;
+		if (not fetch)
+			++m_skipped;
+		return sample(mask, fetch);
+	}
+
+	Signals CardAttributes::sample(std::uint32_t mask, bool fetch) {
+		Signals s{};
+		auto const wants = [mask](Signal sig) { return (mask & (1u << sig)) != 0; };
+		auto const scaled = [](std::optional<std::uint64_t> v, double scale) {
+			return v.has_value() ? static_cast<double>(*v) / scale : 0;
+		};
+		if (wants(Signal::Temp))
+			s[Signal::Temp] = scaled(read(m_temp, fetch), 1000);
+		if (wants(Signal::Busy))
+			s[Signal::Busy] = scaled(read(m_busy, fetch), 1);
+		if (wants(Signal::Power))
+			s[Signal::Power] = power(fetch);
+		if (wants(Signal::Ac))
+			s[Signal::Ac] = read_ac_online();
+		if (wants(Signal::CapMin))
+			s[Signal::CapMin] = scaled(read(m_cap_min, fetch), 1000000);
+		if (wants(Signal::CapMax))
+			s[Signal::CapMax] = scaled(read(m_cap_max, fetch), 1000000);
+		if (wants(Signal::CapDefault))
+			s[Signal::CapDefault] = scaled(read(m_cap_default, fetch), 1000000);
+		if (wants(Signal::Hour)) {
+			auto const now = std::time(nullptr);
+			struct tm tm{};
+			::localtime_r(&now, &tm);
+			s[Signal::Hour] = tm.tm_hour + tm.tm_min / 60.0;
+		}
+		return s;
+	}
+}
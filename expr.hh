@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "estimate.hh"
+#include "sysfs.hh"
+
+namespace powercap {
+
+	// The live values an expression can refer to
+	enum Signal : unsigned {
+		Temp = 0,	// edge temperature in °C
+		Busy,		// gpu_busy_percent
+		Power,		// estimated board power in W
+		Ac,		// 1 when running on mains (or without battery), else 0
+		CapMin,		// power1_cap_min in W, called min
+		CapMax,		// power1_cap_max in W, called max
+		CapDefault,	// power1_cap_default in W, called default
+		Hour,		// local time of the day in hours, e.g. 13.5
+		SignalCount,
+	};
+
+	using Signals = std::array<double, SignalCount>;
+
+	// At least this gpu_busy_percent a card runs what its cap allows
+	constexpr double loaded_busy_percent = 80;
+
+	// A cap expression like "clamp(max * (1 - (temp - 70) / 20), min, max)",
+	// compiled once into a small stack program. Evaluating it does not
+	// allocate, so it can run for every card on every tick.
+	class Expression {
+	public:
+		// Returns nullptr and a message if the source is invalid
+		static std::shared_ptr<Expression const> compile(std::string_view src, std::string& error);
+
+		double evaluate(Signals const& s) const;
+
+		// Bitmask of the signals used, so we only read what is needed
+		std::uint32_t uses() const {
+			return m_uses;
+		}
+
+	private:
+		enum class Code : std::uint8_t {
+			Const,
+			Load,
+			Neg,
+			Not,
+			Add,
+			Sub,
+			Mul,
+			Div,
+			Lt,
+			Le,
+			Gt,
+			Ge,
+			Eq,
+			Ne,
+			And,
+			Or,
+			Min,
+			Max,
+			Clamp,
+			If,
+		};
+
+		struct Op {
+			Code code;
+			double value;
+		};
+
+		// Upper limit for the evaluation stack, checked while compiling
+		static constexpr std::size_t max_depth = 32;
+
+		friend class ExpressionCompiler;
+
+		std::vector<Op> m_code;
+		std::uint32_t m_uses = 0;
+	};
+
+	// The attributes of a card that get polled, they stay open between
+	// two samples.
+	class CardAttributes {
+	public:
+		explicit CardAttributes(std::string hwmon);
+
+		std::string const& hwmon() const {
+			return m_hwmon;
+		}
+
+		// Most of these reads end up as a message to the SMU. Within a round
+		// each attribute is read from the device at most once, however many
+		// parts of the daemon ask for it. Without rounds every call reads.
+		void next_round();
+
+		// Limits the device reads to this many per minute, 0 for no limit.
+		// Only monitor() holds back, reads that steer the caps always happen.
+		void set_budget(unsigned reads_per_minute) {
+			m_budget = reads_per_minute;
+		}
+
+		// Read the signals in mask
+		Signals sample(std::uint32_t mask);
+
+		// Like sample(), but once the budget is used up it returns what was
+		// read last
+		Signals monitor(std::uint32_t mask);
+
+		std::optional<std::uint64_t> cap();
+		std::optional<std::uint64_t> cap_min();
+		std::optional<std::uint64_t> cap_max();
+		std::optional<std::uint64_t> cap_default();
+
+		// Writes power1_cap, reads later in the round see the new value
+		int set_cap(std::uint64_t uw);
+
+		// temp1_crit in m°C, it does not change, so it is read only once
+		std::optional<std::uint64_t> temp_crit();
+
+		// How far off the power signal may be, one standard deviation in W
+		double power_error() const {
+			return m_power.error();
+		}
+
+		// The current level of pp_dpm_sclk in MHz
+		std::optional<unsigned> sclk();
+
+		// Reading from a suspended device would wake it up
+		bool is_suspended();
+
+		// Device reads done, and the ones monitor() held back
+		std::uint64_t reads() const {
+			return m_reads;
+		}
+		std::uint64_t skipped() const {
+			return m_skipped;
+		}
+
+	private:
+		// An attribute together with what it read last
+		struct Cached {
+			explicit Cached(std::string path) : attribute{ std::move(path) } {}
+
+			Attribute attribute;
+			std::optional<std::uint64_t> value;
+			// The round value belongs to
+			std::uint64_t round = 0;
+			// Whether it ever could be read, a power source that never
+			// could is not tried again
+			bool seen = false;
+			bool missing = false;
+		};
+
+		// With fetch false only what was read before
+		std::optional<std::uint64_t> read(Cached& c, bool fetch = true);
+		Signals sample(std::uint32_t mask, bool fetch);
+		void count_read();
+		// Feeds what the card offers into the estimate, once per round
+		double power(bool fetch);
+		std::optional<std::uint64_t> read_source(Cached& c);
+
+		std::string m_hwmon;
+		Cached m_cap;
+		Cached m_cap_min;
+		Cached m_cap_max;
+		Cached m_cap_default;
+		Cached m_temp;
+		std::optional<std::uint64_t> m_temp_crit;
+		bool m_temp_crit_read = false;
+		Cached m_busy;
+		Cached m_power_average;
+		Cached m_power_input;
+		Cached m_energy;
+		PowerEstimate m_power;
+		std::uint64_t m_power_round = 0;
+		std::optional<std::uint64_t> m_last_uj;
+		std::chrono::steady_clock::time_point m_last_uj_at{};
+		Attribute m_runtime_status;
+		bool m_suspended = false;
+		std::uint64_t m_suspended_round = 0;
+		Attribute m_sclk;
+		std::optional<unsigned> m_sclk_value;
+		std::uint64_t m_sclk_round = 0;
+
+		// 0 until next_round() got called
+		std::uint64_t m_round = 0;
+		unsigned m_budget = 0;
+		std::chrono::steady_clock::time_point m_window{};
+		unsigned m_window_reads = 0;
+		std::uint64_t m_reads = 0;
+		std::uint64_t m_skipped = 0;
+	};
+}
@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+
+#include "powercap.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "state.hh"
+#include "sysfs.hh"
+
+#define PC_EXPORT __attribute__((visibility("default")))
+
+struct powercap_card {
+	std::string slot;
+	std::string hwmon;
+	int index = -1;
+};
+
+struct powercap_list {
+	std::vector<powercap_card> cards;
+};
+
+struct powercap_snapshot {
+	std::vector<powercap::CardState> cards;
+};
+
+using namespace powercap;
+
+namespace {
+
+	int read_uint64(powercap_card const* card, char const* attr, uint64_t* out) {
+		if (card == nullptr or out == nullptr)
+			return -EINVAL;
+		auto const v = read_dec_uint64_value_from(card->hwmon + attr);
+		if (not v.has_value())
+			return -ENODATA;
+		*out = *v;
+		return 0;
+	}
+}
+
+extern "C" {
+
+// Nothing may throw into C code, the entry points that allocate catch
+// everything. All we could throw is std::bad_alloc anyway.
+
+PC_EXPORT int powercap_list_new(powercap_list** list) {
+	if (list == nullptr)
+		return -EINVAL;
+	auto* l = new (std::nothrow) powercap_list;
+	if (l == nullptr)
+		return -ENOMEM;
+	try {
+		for (auto& hwmon : find_all_hwmon_base_paths()) {
+			powercap_card c;
+			c.slot = pci_slot_of(hwmon);
+			c.index = card_index_of(hwmon);
+			c.hwmon = std::move(hwmon);
+			l->cards.push_back(std::move(c));
+		}
+	} catch (...) {
+		delete l;
+		return -ENOMEM;
+	}
+	*list = l;
+	return 0;
+}
+
+PC_EXPORT void powercap_list_free(powercap_list* list) {
+	delete list;
+}
+
+PC_EXPORT size_t powercap_list_size(powercap_list const* list) {
+	return list ? list->cards.size() : 0;
+}
+
+PC_EXPORT powercap_card const* powercap_list_get(powercap_list const* list, size_t idx) {
+	if (list == nullptr or idx >= list->cards.size())
+		return nullptr;
+	return &list->cards[idx];
+}
+
+PC_EXPORT char const* powercap_card_slot(powercap_card const* card) {
+	return card ? card->slot.c_str() : nullptr;
+}
+
+PC_EXPORT char const* powercap_card_hwmon(powercap_card const* card) {
+	return card ? card->hwmon.c_str() : nullptr;
+}
+
+PC_EXPORT int powercap_card_index(powercap_card const* card) {
+	return card ? card->index : -1;
+}
+
+PC_EXPORT int powercap_card_get_range(powercap_card const* card, uint64_t* min_uw, uint64_t* max_uw, uint64_t* default_uw) {
+	if (card == nullptr)
+		return -EINVAL;
+	try {
+		int err = 0;
+		if (min_uw and (err = read_uint64(card, "/power1_cap_min", min_uw)) < 0)
+			return err;
+		if (max_uw and (err = read_uint64(card, "/power1_cap_max", max_uw)) < 0)
+			return err;
+		if (default_uw and (err = read_uint64(card, "/power1_cap_default", default_uw)) < 0)
+			return err;
+		return 0;
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+PC_EXPORT int powercap_card_get_cap(powercap_card const* card, uint64_t* cap_uw) {
+	try {
+		return read_uint64(card, "/power1_cap", cap_uw);
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+// Like the binary we record the cap in the run state, so the watch daemon
+// keeps it instead of re-asserting the old one.
+PC_EXPORT int powercap_card_set_cap(powercap_card const* card, uint64_t cap_uw) {
+	if (card == nullptr)
+		return -EINVAL;
+	try {
+		if (auto const err = write_dec_uint64_value_to(card->hwmon + "/power1_cap", cap_uw); err < 0)
+			return err;
+		record_cap(card->hwmon, cap_uw);
+		return 0;
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+PC_EXPORT int powercap_card_read_power(powercap_card const* card, uint64_t* power_uw) {
+	try {
+		// Some boards only offer the instant value
+		auto const err = read_uint64(card, "/power1_average", power_uw);
+		if (err == -ENODATA)
+			return read_uint64(card, "/power1_input", power_uw);
+		return err;
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+PC_EXPORT int powercap_card_read_temp(powercap_card const* card, int32_t* millidegrees) {
+	if (card == nullptr or millidegrees == nullptr)
+		return -EINVAL;
+	try {
+		// Unlike the other attributes this one can be negative
+		auto const v = read_string_from(card->hwmon + "/temp1_input");
+		if (not v.has_value() or v->empty())
+			return -ENODATA;
+		*millidegrees = static_cast<int32_t>(std::strtol(v->c_str(), nullptr, 10));
+		return 0;
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+PC_EXPORT int powercap_card_read_busy(powercap_card const* card, unsigned* percent) {
+	try {
+		uint64_t v = 0;
+		auto const err = read_uint64(card, "/device/gpu_busy_percent", &v);
+		if (err == 0 and percent)
+			*percent = static_cast<unsigned>(v);
+		return err;
+	} catch (...) {
+		return -ENOMEM;
+	}
+}
+
+PC_EXPORT int powercap_snapshot_take(powercap_list const* list, powercap_snapshot** snapshot) {
+	if (list == nullptr or snapshot == nullptr)
+		return -EINVAL;
+	auto* s = new (std::nothrow) powercap_snapshot;
+	if (s == nullptr)
+		return -ENOMEM;
+	try {
+		for (auto const& c : list->cards) {
+			CardState state;
+			state.slot = c.slot;
+			state.hwmon = c.hwmon;
+			auto const cap = read_dec_uint64_value_from(c.hwmon + "/power1_cap");
+			if (not cap.has_value() or not stamp(state))
+				continue;
+			state.cap = *cap;
+			s->cards.push_back(std::move(state));
+		}
+	} catch (...) {
+		delete s;
+		return -ENOMEM;
+	}
+	*snapshot = s;
+	return 0;
+}
+
+PC_EXPORT int powercap_snapshot_restore(powercap_snapshot const* snapshot) {
+	if (snapshot == nullptr)
+		return -EINVAL;
+	// Keep going on errors, restore as much as we can
+	int ret = 0;
+	for (auto const& c : snapshot->cards) {
+		try {
+			// Do not write to whatever got the hwmon number after a reload
+			if (not is_valid(c)) {
+				ret = -ENODEV;
+				continue;
+			}
+			if (auto const err = write_dec_uint64_value_to(c.hwmon + "/power1_cap", c.cap); err < 0) {
+				ret = err;
+				continue;
+			}
+			record_cap(c.hwmon, c.cap);
+		} catch (...) {
+			ret = -ENOMEM;
+		}
+	}
+	return ret;
+}
+
+PC_EXPORT void powercap_snapshot_free(powercap_snapshot* snapshot) {
+	delete snapshot;
+}
+
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.1-or-later */
+/* Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net> */
+#ifndef POWERCAP_H
+#define POWERCAP_H
+
+/*
+ * Set power-limits on AMD GPUs without spawning the powercap binary.
+ *
+ * All power values are in micro watts, like sysfs uses them. Functions
+ * returning int give 0 on success and a negative errno value on failure.
+ * The structures are opaque, so they can grow without breaking the ABI.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct powercap_list powercap_list;
+typedef struct powercap_card powercap_card;
+typedef struct powercap_snapshot powercap_snapshot;
+
+/* Enumerate all cards that allow to set a power-limit */
+int powercap_list_new(powercap_list **list);
+void powercap_list_free(powercap_list *list);
+size_t powercap_list_size(powercap_list const *list);
+/* The card stays valid as long as the list does */
+powercap_card const *powercap_list_get(powercap_list const *list, size_t idx);
+
+/* The pci slot, e.g. "0000:03:00.0" */
+char const *powercap_card_slot(powercap_card const *card);
+/* The sysfs hwmon directory */
+char const *powercap_card_hwmon(powercap_card const *card);
+/* The N of /sys/class/drm/cardN, -1 if unknown */
+int powercap_card_index(powercap_card const *card);
+
+int powercap_card_get_range(powercap_card const *card, uint64_t *min_uw, uint64_t *max_uw, uint64_t *default_uw);
+int powercap_card_get_cap(powercap_card const *card, uint64_t *cap_uw);
+/* The cap also goes into the run state, the watch daemon keeps it */
+int powercap_card_set_cap(powercap_card const *card, uint64_t cap_uw);
+
+/* Telemetry, reading it wakes up a runtime suspended card */
+int powercap_card_read_power(powercap_card const *card, uint64_t *power_uw);
+int powercap_card_read_temp(powercap_card const *card, int32_t *millidegrees);
+int powercap_card_read_busy(powercap_card const *card, unsigned *percent);
+
+/* Remember the current caps of all cards in the list and put them back
+ * later, e.g. around a job that wants a different limit. */
+int powercap_snapshot_take(powercap_list const *list, powercap_snapshot **snapshot);
+int powercap_snapshot_restore(powercap_snapshot const *snapshot);
+void powercap_snapshot_free(powercap_snapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POWERCAP_H */
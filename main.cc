@@ -11,158 +11,653 @@
  * def_power=`cat $PATH_TO_POWER/power1_cap_default`
  *
  * echo $min_power | tee $PATH_TO_POWER/power1_cap
+ *
+ * We run on every boot and from launchers, so we stick to plain syscalls
+ * and stdio here. No iostreams, no std::filesystem and no option parser
+ * library, all of them cost more at startup than the actual work.
  */
 
-#include <cerrno>
+#include <cinttypes>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 #include <array>
-#include <exception>
-#include <filesystem>
-#include <fstream>
-#include <iostream>
+#include <chrono>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
 
-#include <cxxopts.hpp>
+#include <unistd.h>
+
+#include "autotune.hh"
+#include "calibrate.hh"
+#include "config.hh"
+#include "evaluate.hh"
+#include "recorder.hh"
+#include "report.hh"
+#include "run.hh"
+#include "state.hh"
+#include "sysfs.hh"
+#include "watch.hh"
 
-namespace fs = std::filesystem;
+using namespace powercap;
 
 namespace {
 
-	constexpr inline bool starts_with(std::string_view str, std::string_view prefix) {
-		auto const hsl = str.length();
-		auto const hl = prefix.length();
-		return hsl >= hl and std::string_view{ str.data(), hl }.compare(prefix) == 0;
+	enum Action {
+		RestoreDefault = 0,
+		SetToMin,
+		SetToMax,
+		// The lowest calibrated cap that sustains a sclk
+		TargetSclk,
+	};
+
+	// Measures the time between two points of our own execution. Used to tell
+	// apart the time we spend looking for the device from the time the driver
+	// (and the SMU behind it) needs to accept a new power-limit.
+	class Stopwatch {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		Stopwatch() : m_start{ clock::now() } {}
+
+		std::uint64_t elapsed_us() const {
+			auto const d = clock::now() - m_start;
+			return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		}
+
+	private:
+		clock::time_point m_start;
+	};
+
+	inline std::string_view to_string(Action a) {
+		switch (a) {
+		case Action::SetToMin: return "minimal";
+		case Action::SetToMax: return "maximal";
+		case Action::RestoreDefault: return "default";
+		case Action::TargetSclk: return "the target sclk";
+		}
+		return "";
 	}
 
-	std::optional<std::string> read_string_from(fs::path const& p) {
-		std::ifstream f(p);
-		if (not f.is_open())
-			return {};
-		std::string s;
-		std::getline(f, s);
-		return s;
+	void print_usage(char const* name) {
+		std::printf(
+			"Set power-limits on AMD GPUs\n"
+			"Usage:\n"
+			"  %s [OPTION...]\n"
+			"  %s report [--json] [FILE...]\n"
+			"  %s evaluate [--json] [--config PATH] [--limits MIN:MAX:DEFAULT] [PATH...]\n"
+			"  %s run [--json FILE] [--progress FILE [--total N] --deadline WHEN]\n"
+			"      [--progress FILE --floor FRACTION] [--fan WATTS] [--] COMMAND [ARG...]\n"
+			"  %s calibrate [--device PATH] [--steps N] [--seconds S]\n"
+			"  %s autotune [--device PATH] [--seconds S]\n"
+			"\n"
+			"  -v, --verbose  Enable extra messages\n"
+			"      --min      Set power limits to minimum (default)\n"
+			"      --max      Set power limits to maximum\n"
+			"      --default  Restore driver default value\n"
+			"      --target-sclk MHZ\n"
+			"                 Set the lowest power limit that sustained the given\n"
+			"                 sclk during calibration\n"
+			"      --config PATH\n"
+			"                 Per card rules, used unless --min, --max or --default\n"
+			"                 is given (default: %s)\n"
+			"      --check-config\n"
+			"                 Only check the config for errors\n"
+			"      --device PATH\n"
+			"                 Only handle the given hwmon, drm or pci sysfs device\n"
+			"      --watch[=SECONDS]\n"
+			"                 Keep running and restore the power limits whenever\n"
+			"                 someone else changes them (every 10s by default)\n"
+			"      --read-budget=N\n"
+			"                 Read each card at most N times a minute while watching,\n"
+			"                 reads needed to keep the limits in place go first\n"
+			"  -h, --help     Print usage\n"
+			"\n"
+			"report summarizes what the watch daemon recorded, by default in %s\n"
+			"evaluate replays the recordings (by default all in its directory) under\n"
+			"min, max, default and the profiles and rules of the config, and compares the\n"
+			"energy saved, throughput lost, cap writes and thermal violations, limits are\n"
+			"given in W for cards that are not present\n"
+			"run executes the command and reports the energy the cards used meanwhile,\n"
+			"with a deadline (HH:MM or +N[smh]) it keeps the power limits as low as the\n"
+			"progress the command writes to the progress file allows, with a floor\n"
+			"as low as keeps that progress at the given fraction of its rate at the\n"
+			"maximum power limits, with --fan also the fan speed with the lowest total\n"
+			"draw, given the draw of the fans at full speed\n"
+			"calibrate records the sclk each power limit sustains, while the cards are\n"
+			"kept busy, in %s\n"
+			"autotune measures how fast the draw of the busy cards follows a change of\n"
+			"the power limit, run waits that long between two changes, kept in %s\n",
+			name, name, name, name, name, name, default_config_path, recorder_file, calibration_file, dynamics_file);
 	}
 
-	std::optional<std::uint64_t> read_dec_uint64_value_from(fs::path const& p) {
-		auto v = read_string_from(p);
-		if (v.has_value()) try {
-			return std::stoul(v.value());
-		} catch (std::exception const& e) {
-			std::cerr << "Unable to convert " << v.value() << " to unsigned value: " << e.what() << std::endl;
+	// powercap report [--json] [FILE...]
+	std::optional<ReportOptions> parse_report_options(int argc, char* argv[]) {
+		ReportOptions o;
+		for (int i = 2; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			if (arg == "--json") {
+				o.json = true;
+			} else if (starts_with(arg, "-")) {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			} else {
+				o.files.push_back(argv[i]);
+			}
 		}
-		return {};
+		return o;
 	}
 
-	inline int write_dec_uint64_value_to(fs::path const& p, std::uint64_t v) {
-		std::ofstream f{p};
-		if (not f.is_open())
-			return -EPERM;
-		std::cout << "Trying to write " << (v / 1000) << " to " << p << "...\n";
-		f << v;
-		return 0;
+	// MIN:MAX:DEFAULT in W
+	bool parse_limits(std::string_view v, EvaluateOptions& o) {
+		std::array<double, 3> w;
+		for (std::size_t i = 0; i < w.size(); ++i) {
+			// Exactly three fields, nothing after the last one
+			auto const colon = v.find(':');
+			bool const last = i + 1 == w.size();
+			if ((colon == v.npos) != last)
+				return false;
+			auto const field = std::string{ v.substr(0, colon) };
+			char* end = nullptr;
+			w[i] = std::strtod(field.c_str(), &end);
+			if (field.empty() or *end != '\0' or w[i] <= 0)
+				return false;
+			v.remove_prefix(last ? v.size() : colon + 1);
+		}
+		if (w[0] > w[1])
+			return false;
+		o.min = w[0];
+		o.max = w[1];
+		o.fallback_default = w[2];
+		return true;
 	}
 
-	inline int write_dec_uint64_value_to(fs::path const& p, std::optional<std::uint64_t> const& v) {
-		if (not v.has_value())
-			return -ENODATA;
-		return write_dec_uint64_value_to(p, v.value());
+	// powercap evaluate [--json] [--config PATH] [--limits MIN:MAX:DEFAULT] [PATH...]
+	std::optional<EvaluateOptions> parse_evaluate_options(int argc, char* argv[]) {
+		EvaluateOptions o;
+		for (int i = 2; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			if (arg == "--json") {
+				o.json = true;
+			} else if (arg == "--config" and i + 1 < argc) {
+				o.config = argv[++i];
+			} else if (arg == "--limits" and i + 1 < argc) {
+				if (not parse_limits(argv[++i], o)) {
+					std::fprintf(stderr, "Invalid limits: %s, expected MIN:MAX:DEFAULT in W\n", argv[i]);
+					return {};
+				}
+			} else if (starts_with(arg, "-")) {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			} else {
+				o.paths.push_back(argv[i]);
+			}
+		}
+		return o;
 	}
 
-	// Try to find the first card entry
-	std::string find_card_base_path() {
-		fs::path const base_path{ "/sys/class/drm" };
-		for (auto const& dir_entry : fs::directory_iterator{ base_path }) {
-			if (not dir_entry.is_directory())
-				continue;
-			auto const p = dir_entry.path();
-			if (not starts_with(p.filename().string(), "card"))
-				continue;
-			return p.string();
+	// powercap calibrate [--device PATH] [--steps N] [--seconds S]
+	std::optional<CalibrateOptions> parse_calibrate_options(int argc, char* argv[]) {
+		CalibrateOptions o;
+		for (int i = 2; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			bool const has_number = i + 1 < argc and is_digits(argv[i + 1]);
+			if (arg == "--device" and i + 1 < argc) {
+				o.device = argv[++i];
+			} else if (arg == "--steps" and has_number) {
+				o.steps = std::strtoul(argv[++i], nullptr, 10);
+			} else if (arg == "--seconds" and has_number) {
+				o.seconds = std::strtoul(argv[++i], nullptr, 10);
+			} else {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			}
 		}
-		return "";
+		return o;
 	}
 
-	// Try to figure the hwmon entry
-	std::string find_hwmon_base_path(fs::path const& p) {
-		fs::path const base_path{ p / "device/hwmon" };
-		for (auto const& dir_entry : fs::directory_iterator{ base_path }) {
-			if (not dir_entry.is_directory())
-				continue;
-			return dir_entry.path().string();
+	// powercap autotune [--device PATH] [--seconds S]
+	std::optional<AutotuneOptions> parse_autotune_options(int argc, char* argv[]) {
+		AutotuneOptions o;
+		for (int i = 2; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			if (arg == "--device" and i + 1 < argc) {
+				o.device = argv[++i];
+			} else if (arg == "--seconds" and i + 1 < argc and is_digits(argv[i + 1])) {
+				o.seconds = std::strtoul(argv[++i], nullptr, 10);
+			} else {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			}
 		}
-		return "";
+		return o;
 	}
 
-	enum Action {
-		RestoreDefault = 0,
-		SetToMin,
-		SetToMax,
+	// Either HH:MM, the next time the clock shows it, or +N with an optional
+	// s, m or h suffix from now on
+	std::optional<std::time_t> parse_deadline(std::string_view v) {
+		auto const now = std::time(nullptr);
+		if (starts_with(v, "+")) {
+			v.remove_prefix(1);
+			unsigned scale = 1;
+			if (not v.empty() and (v.back() == 's' or v.back() == 'm' or v.back() == 'h')) {
+				scale = v.back() == 'h' ? 3600 : v.back() == 'm' ? 60 : 1;
+				v.remove_suffix(1);
+			}
+			if (not is_digits(v) or v.size() > 9)
+				return {};
+			return now + static_cast<std::time_t>(std::strtoul(std::string{ v }.c_str(), nullptr, 10) * scale);
+		}
+		if (v.size() != 5 or v[2] != ':' or not is_digits(v.substr(0, 2)) or not is_digits(v.substr(3)))
+			return {};
+		struct tm tm{};
+		::localtime_r(&now, &tm);
+		tm.tm_hour = (v[0] - '0') * 10 + (v[1] - '0');
+		tm.tm_min = (v[3] - '0') * 10 + (v[4] - '0');
+		tm.tm_sec = 0;
+		if (tm.tm_hour > 23 or tm.tm_min > 59)
+			return {};
+		auto t = std::mktime(&tm);
+		if (t <= now) {
+			++tm.tm_mday;
+			tm.tm_isdst = -1;
+			t = std::mktime(&tm);
+		}
+		return t;
+	}
+
+	// powercap run [--json FILE] [--progress FILE [--total N] --deadline WHEN | --floor F] [--] COMMAND [ARG...]
+	std::optional<RunOptions> parse_run_options(int argc, char* argv[]) {
+		RunOptions o;
+		int i = 2;
+		for (; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			if (arg == "--json" and i + 1 < argc) {
+				o.json = argv[++i];
+			} else if (starts_with(arg, "--json=")) {
+				o.json = argv[i] + std::strlen("--json=");
+			} else if (arg == "--progress" and i + 1 < argc) {
+				o.progress = argv[++i];
+			} else if (arg == "--total" and i + 1 < argc and std::strtod(argv[i + 1], nullptr) > 0) {
+				o.total = std::strtod(argv[++i], nullptr);
+			} else if (arg == "--floor" and i + 1 < argc) {
+				o.floor = std::strtod(argv[++i], nullptr);
+				if (o.floor <= 0 or o.floor > 1) {
+					std::fprintf(stderr, "The floor has to be above 0 and at most 1\n");
+					return {};
+				}
+			} else if (arg == "--fan" and i + 1 < argc and std::strtod(argv[i + 1], nullptr) > 0) {
+				o.fan = std::strtod(argv[++i], nullptr);
+			} else if (arg == "--deadline" and i + 1 < argc) {
+				auto const deadline = parse_deadline(argv[++i]);
+				if (not deadline.has_value()) {
+					std::fprintf(stderr, "Invalid deadline: %s\n", argv[i]);
+					return {};
+				}
+				o.deadline = *deadline;
+			} else if (arg == "--") {
+				++i;
+				break;
+			} else if (starts_with(arg, "-")) {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			} else {
+				break;
+			}
+		}
+		if (i >= argc)
+			return {};
+		if ((o.deadline != 0 or o.floor > 0) and o.progress == nullptr) {
+			std::fprintf(stderr, "A deadline or floor needs --progress\n");
+			return {};
+		}
+		if (o.fan > 0 and o.deadline == 0 and o.floor <= 0) {
+			std::fprintf(stderr, "The fans are only searched along with a deadline or floor\n");
+			return {};
+		}
+		if (o.deadline != 0 and o.floor > 0) {
+			std::fprintf(stderr, "Either a deadline or a floor\n");
+			return {};
+		}
+		o.argv = argv + i;
+		return o;
+	}
+
+	struct Options {
+		Action what_to_do = Action::SetToMin;
+		bool action_given = false;
+		char const* config = default_config_path;
+		bool check_config = false;
+		bool verbose = false;
+		bool help = false;
+		char const* device = nullptr;
+		bool watch = false;
+		unsigned interval = 10;
+		unsigned read_budget = 0;
+		unsigned target_sclk = 0;
 	};
 
-	inline std::string_view to_string(Action a) {
-		switch (a) {
-		case Action::SetToMin: return "minimal";
-		case Action::SetToMax: return "maximal";
-		case Action::RestoreDefault: return "default";
+	// The handful of flags we know does not justify an option parser, the
+	// last of --min/--max/--default wins.
+	std::optional<Options> parse_options(int argc, char* argv[]) {
+		Options o;
+		for (int i = 1; i < argc; ++i) {
+			std::string_view const arg{ argv[i] };
+			if (arg == "--min")
+				o.what_to_do = Action::SetToMin;
+			else if (arg == "--max")
+				o.what_to_do = Action::SetToMax;
+			else if (arg == "--default")
+				o.what_to_do = Action::RestoreDefault;
+			else if (arg == "--target-sclk" and i + 1 < argc and is_digits(argv[i + 1])) {
+				o.what_to_do = Action::TargetSclk;
+				o.target_sclk = std::strtoul(argv[++i], nullptr, 10);
+			} else if (starts_with(arg, "--target-sclk=") and is_digits(arg.substr(std::strlen("--target-sclk=")))) {
+				o.what_to_do = Action::TargetSclk;
+				o.target_sclk = std::strtoul(argv[i] + std::strlen("--target-sclk="), nullptr, 10);
+			}
+			else if (arg == "--config" and i + 1 < argc)
+				o.config = argv[++i];
+			else if (starts_with(arg, "--config="))
+				o.config = argv[i] + std::strlen("--config=");
+			else if (arg == "--check-config")
+				o.check_config = true;
+			else if (arg == "-v" or arg == "--verbose")
+				o.verbose = true;
+			else if (arg == "-h" or arg == "--help")
+				o.help = true;
+			else if (arg == "--device" and i + 1 < argc)
+				o.device = argv[++i];
+			else if (starts_with(arg, "--device="))
+				o.device = argv[i] + std::strlen("--device=");
+			else if (arg == "--watch")
+				o.watch = true;
+			else if (starts_with(arg, "--watch=") and is_digits(arg.substr(std::strlen("--watch=")))) {
+				o.watch = true;
+				o.interval = std::strtoul(argv[i] + std::strlen("--watch="), nullptr, 10);
+				if (o.interval == 0)
+					o.interval = 1;
+			} else if (starts_with(arg, "--read-budget=") and is_digits(arg.substr(std::strlen("--read-budget=")))) {
+				o.read_budget = std::strtoul(argv[i] + std::strlen("--read-budget="), nullptr, 10);
+			} else {
+				std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return {};
+			}
+			if (arg == "--min" or arg == "--max" or arg == "--default" or starts_with(arg, "--target-sclk"))
+				o.action_given = true;
 		}
-		return "";
+		return o;
+	}
+
+	// Apply the matching rule to every card, or only to the one udev told us
+	// about.
+	int apply_config(RuleTable const& rules, Options const& options) {
+		auto const hwmons = options.device
+			? std::vector<std::string>{ find_hwmon_base_path_for_device(options.device) }
+			: find_all_hwmon_base_paths();
+		auto const minute = current_minute_of_day();
+
+		// Cards that share the equalize budget start with equal shares, the
+		// watch daemon takes it from there. Count them all, also when udev
+		// told us about a single one. When the budget is too small for them
+		// they are left alone.
+		// Cards in use by run, calibrate or autotune are theirs for now.
+		// When one of them shares the budget, the others are left to the
+		// watch daemon, which shares what it leaves.
+		auto const state = load_run_state();
+		std::optional<unsigned> members;
+		bool owned_member = false;
+		if (rules.equalize) {
+			auto const all = find_all_hwmon_base_paths();
+			std::string error;
+			members = check_equalize(*rules.equalize, all, error);
+			if (not members)
+				std::fprintf(stderr, "%s\n", error.c_str());
+			for (auto const& hwmon : all) {
+				auto const id = identify(hwmon);
+				auto const* known = state.find(id.slot);
+				if (known and owner_alive(*known) and matches(rules.equalize->selectors, id)) {
+					if (options.verbose)
+						std::printf("%s is in use by process %" PRIu64 ", leaving the budget to the daemon\n",
+							id.slot.c_str(), known->owner.pid);
+					owned_member = true;
+				}
+			}
+		}
+
+		int ret = 0;
+		for (auto const& hwmon : hwmons) {
+			if (hwmon.empty())
+				continue;
+			auto const id = identify(hwmon);
+			if (auto const* known = state.find(id.slot); known and owner_alive(*known)) {
+				if (options.verbose)
+					std::printf("%s is in use by process %" PRIu64 ", leaving it alone\n", id.slot.c_str(),
+						known->owner.pid);
+				continue;
+			}
+			CardAttributes attrs{ hwmon };
+			std::optional<std::uint64_t> cap;
+			if (rules.equalize and matches(rules.equalize->selectors, id)) {
+				if (not members or owned_member)
+					continue;
+				if (options.verbose)
+					std::printf("Sharing the budget between %u cards for %s...\n", *members, id.slot.c_str());
+				cap = resolve(CapSpec{ CapSpec::Watts, equal_share(rules.equalize->budget, *members), nullptr }, attrs);
+			} else if (auto const* rule = rules.match(id)) {
+				auto const& profile = rules.profile_for(*rule, minute);
+				if (options.verbose)
+					std::printf("Using profile %s for %s...\n", profile.name.c_str(), id.slot.c_str());
+				cap = resolve(profile.cap, attrs);
+			} else {
+				if (options.verbose)
+					std::printf("No rule for %s, leaving it alone\n", id.slot.c_str());
+				continue;
+			}
+
+			if (auto const err = set_power_cap(hwmon, cap); err < 0) {
+				std::fprintf(stderr, "Could not write %s\n", std::strerror(-err));
+				ret = 1;
+				continue;
+			}
+
+			record_cap(hwmon, cap.value());
+		}
+		if (hwmons.empty()) {
+			std::fprintf(stderr, "Unable to find gpu\n");
+			return 1;
+		}
+		return ret;
+	}
+
+	int apply(Options const& options, Stopwatch const& total) {
+		// Without an explicit action the config decides, if there is one
+		if (not options.action_given and ::access(options.config, F_OK) == 0) {
+			std::string error;
+			auto const rules = load_config(options.config, error);
+			if (not rules) {
+				std::fprintf(stderr, "%s\n", error.c_str());
+				return 1;
+			}
+			return apply_config(*rules, options);
+		}
+
+		auto const what_to_do = options.what_to_do;
+		auto const verbose = options.verbose;
+		if (verbose)
+			std::printf("Setting power-target to %s...\n", to_string(what_to_do).data());
+
+		// When called from udev we know the device and must not touch any other.
+		// Otherwise try the card we found last time, as long as the driver has
+		// not been reloaded since, and only scan if that fails.
+		RunStateLock const lock;
+		auto state = load_run_state();
+		CardState card;
+		if (options.device) {
+			card.card = options.device;
+			card.hwmon = find_hwmon_base_path_for_device(card.card);
+		} else if (auto const* cached = state.find(state.primary); cached and is_valid(*cached)) {
+			card = *cached;
+		} else {
+			card.card = find_card_base_path();
+			if (card.card.empty()) {
+				std::fprintf(stderr, "Unable to find gpu\n");
+				return 1;
+			}
+			card.hwmon = find_hwmon_base_path(card.card);
+		}
+
+		if (card.hwmon.empty()) {
+			std::fprintf(stderr, "Unable to find hwmon entries for %s\n", card.card.c_str());
+			return 1;
+		}
+		auto const& hwmon = card.hwmon;
+
+		// Someone who owns the card puts it back, keep what it has to know
+		auto const* known = state.find(card.slot.empty() ? pci_slot_of(hwmon) : card.slot);
+		if (known and owner_alive(*known)) {
+			std::fprintf(stderr, "%s is in use by process %" PRIu64 ", leaving it alone\n", known->slot.c_str(),
+				known->owner.pid);
+			return 0;
+		}
+		auto const owner = known ? known->owner : Owner{};
+
+		static constexpr std::array<std::string_view, 3> pwr_source = {
+			"/power1_cap_default",
+			"/power1_cap_min",
+			"/power1_cap_max"
+		};
+
+		auto const discovery_us = total.elapsed_us();
+
+		auto pwrtarget = what_to_do == Action::TargetSclk
+			? cap_for_sclk(hwmon, options.target_sclk)
+			: read_dec_uint64_value_from(hwmon + std::string{ pwr_source[what_to_do] });
+		if (what_to_do == Action::TargetSclk and not pwrtarget.has_value()) {
+			std::fprintf(stderr, "No calibrated power limit sustains %uMHz, run calibrate first\n", options.target_sclk);
+			return 1;
+		}
+
+		Stopwatch const write;
+		auto err = set_power_cap(hwmon, pwrtarget);
+		auto const write_us = write.elapsed_us();
+		if (err < 0)
+			std::fprintf(stderr, "Could not write %s\n", std::strerror(-err));
+
+		// Remember where the card lives and what we applied
+		if (err == 0 and (not card.ino or card.slot.empty())) {
+			card.slot = pci_slot_of(hwmon);
+			stamp(card);
+		}
+		if (err == 0 and not card.slot.empty()) {
+			card.cap = pwrtarget.value();
+			card.owner = owner;
+			state.update(card);
+			if (not options.device)
+				state.primary = card.slot;
+			if (auto const e = save_run_state(state); e < 0 and verbose)
+				std::fprintf(stderr, "Could not save state: %s\n", std::strerror(-e));
+		}
+
+		if (verbose)
+			std::printf("Took %" PRIu64 "us in total, %" PRIu64 "us to find the device and %" PRIu64 "us for the driver to accept the write\n",
+				total.elapsed_us(), discovery_us, write_us);
+
+		return err < 0 ? 1 : 0;
 	}
 }
 
 int main(int argc, char* argv[])
 {
-	cxxopts::Options options("powercap", "Set power-limits on AMD GPUs");
-	options.add_options()
-		("v,verbose", "Enable extra messages", cxxopts::value<bool>()->default_value("false"))
-		("min", "Set power limits to minimum (default)")
-		("max", "Set power limits to maximum")
-		("default", "Restore driver default value")
-		("h,help", "Print usage")
-		;
-
-	auto result = options.parse(argc, argv);
-	if (result.count("help")) {
-		std::cout << options.help() << std::endl;
-		return 0;
-	}
+	Stopwatch const total;
 
-	Action what_to_do = Action::SetToMin;
-	if (result.count("max"))
-		what_to_do = Action::SetToMax;
-	if (result.count("default"))
-		what_to_do = Action::RestoreDefault;
-
-	auto const verbose = result["verbose"].as<bool>();
-	if (verbose)
-		std::cout << "Setting power-target to " << to_string(what_to_do) << "...\n";
+	if (argc > 1 and std::string_view{ argv[1] } == "report") {
+		auto const o = parse_report_options(argc, argv);
+		if (not o.has_value()) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return report(*o);
+	}
+	if (argc > 1 and std::string_view{ argv[1] } == "evaluate") {
+		auto const o = parse_evaluate_options(argc, argv);
+		if (not o.has_value()) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return evaluate(*o);
+	}
+	if (argc > 1 and std::string_view{ argv[1] } == "calibrate") {
+		auto const o = parse_calibrate_options(argc, argv);
+		if (not o.has_value()) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return calibrate(*o);
+	}
+	if (argc > 1 and std::string_view{ argv[1] } == "autotune") {
+		auto const o = parse_autotune_options(argc, argv);
+		if (not o.has_value()) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return autotune(*o);
+	}
+	if (argc > 1 and std::string_view{ argv[1] } == "run") {
+		auto const o = parse_run_options(argc, argv);
+		if (not o.has_value()) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return run(*o);
+	}
 
-	auto const card = find_card_base_path();
-	if (card.empty()) {
-		std::cerr << "Unable to find gpu\n";
+	auto const options = parse_options(argc, argv);
+	if (not options.has_value()) {
+		print_usage(argv[0]);
 		return 1;
 	}
+	if (options->help) {
+		print_usage(argv[0]);
+		return 0;
+	}
 
-    auto const hwmon = find_hwmon_base_path(card);
-	if (hwmon.empty()) {
-		std::cerr << "Unable to find hwmon entries for " << card << "\n";
-		return 1;
+	if (options->check_config) {
+		std::string error;
+		auto const rules = load_config(options->config, error);
+		if (not rules or (rules->equalize
+			and not check_equalize(*rules->equalize, find_all_hwmon_base_paths(), error)))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		return 0;
 	}
 
-	static constexpr std::array<std::string_view, 3> pwr_source = {
-		"/power1_cap_default",
-		"/power1_cap_min",
-		"/power1_cap_max"
-	};
+	// When the previous instance re-executed us it kept the caps in place,
+	// so we just carry on watching them.
+	int handoff = -1;
+	if (auto const* fd = std::getenv(handoff_env); fd != nullptr and options->watch) {
+		handoff = std::strtol(fd, nullptr, 10);
+		::unsetenv(handoff_env);
+	}
 
-	auto pwrtarget = read_dec_uint64_value_from(hwmon + std::string{ pwr_source[what_to_do] });
-	auto err = write_dec_uint64_value_to(hwmon + "/power1_cap", pwrtarget);
-	if (err < 0)
-		std::cerr << "Could not write " << std::strerror(-err) << std::endl;
+	auto const err = handoff < 0 ? apply(*options, total) : 0;
+	if (not options->watch)
+		return err;
 
-	return 0;
+	WatchOptions w;
+	w.interval = options->interval;
+	w.verbose = options->verbose;
+	w.read_budget = options->read_budget;
+	if (not options->action_given)
+		w.config = options->config;
+	w.argv = argv;
+	w.handoff = handoff;
+	return watch(w);
 }
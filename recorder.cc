@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * The ring is a RecorderHeader followed by capacity records. Writing a
+ * record and bumping head is all a round costs, the page cache writes it
+ * back whenever it likes. Dumps are plain copies of the whole file, named
+ * after the time they were taken, only the newest dump_keep are kept.
+ */
+
+#include "recorder.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		constexpr char magic[8] = { 'P', 'C', 'R', 'E', 'C', '0', '0', '1' };
+
+		// About half an hour of two cards polled every second
+		constexpr std::uint32_t capacity = 4096;
+		constexpr std::size_t file_size = sizeof(RecorderHeader) + capacity * sizeof(Record);
+
+		// Something that keeps going wrong must not fill the disk
+		constexpr std::chrono::seconds dump_interval{ 60 };
+		constexpr int dump_keep = 16;
+
+		// Like "reset, power spike"
+		void describe(std::uint8_t events, char* buf, std::size_t size) {
+			static constexpr struct {
+				Event event;
+				char const* name;
+			} names[] = {
+				{ WriteFailed, "write failure" },
+				{ Reset, "reset" },
+				{ Thermal, "thermal limit" },
+				{ Spike, "power spike" },
+			};
+			std::size_t len = 0;
+			buf[0] = '\0';
+			for (auto const& n : names) {
+				if ((events & n.event) == 0 or len >= size)
+					continue;
+				auto const w = std::snprintf(buf + len, size - len, "%s%s", len > 0 ? ", " : "", n.name);
+				if (w > 0)
+					len += static_cast<std::size_t>(w);
+			}
+		}
+
+		int is_dump(struct dirent const* e) {
+			std::string_view const name{ e->d_name };
+			constexpr std::string_view suffix = ".rec";
+			return starts_with(name, "dump-") and name.size() > suffix.size()
+				and name.substr(name.size() - suffix.size()) == suffix;
+		}
+
+		// Names sort by time, drop all but the newest dumps
+		void prune(std::string const& dir) {
+			int const dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dirfd < 0)
+				return;
+			struct dirent** entries = nullptr;
+			int const n = ::scandirat(dirfd, ".", &entries, is_dump, ::alphasort);
+			if (n < 0) {
+				::close(dirfd);
+				return;
+			}
+			for (int i = 0; i < n; ++i) {
+				if (i < n - dump_keep)
+					::unlinkat(dirfd, entries[i]->d_name, 0);
+				std::free(entries[i]);
+			}
+			std::free(entries);
+			::close(dirfd);
+		}
+
+		int write_all(int fd, void const* data, std::size_t size) {
+			auto const* p = static_cast<char const*>(data);
+			while (size > 0) {
+				auto const n = ::write(fd, p, size);
+				if (n < 0 and errno == EINTR)
+					continue;
+				if (n < 0)
+					return -errno;
+				p += n;
+				size -= static_cast<std::size_t>(n);
+			}
+			return 0;
+		}
+	}
+
+	int load_records(char const* path, std::vector<Record>& out) {
+		int const fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+		struct stat st{};
+		if (::fstat(fd, &st) < 0 or static_cast<std::size_t>(st.st_size) < sizeof(RecorderHeader)) {
+			::close(fd);
+			return -EINVAL;
+		}
+		auto const size = static_cast<std::size_t>(st.st_size);
+		void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return -errno;
+
+		auto const* header = static_cast<RecorderHeader const*>(p);
+		auto const* records = reinterpret_cast<Record const*>(header + 1);
+		int err = 0;
+		if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 or header->record_size != sizeof(Record)
+			or header->capacity == 0 or size < sizeof(RecorderHeader) + header->capacity * sizeof(Record))
+		{
+			err = -EINVAL;
+		} else {
+			auto const n = std::min<std::uint64_t>(header->head, header->capacity);
+			out.reserve(out.size() + n);
+			for (auto i = header->head - n; i < header->head; ++i)
+				out.push_back(records[i % header->capacity]);
+		}
+		::munmap(p, size);
+		return err;
+	}
+
+	void merge_records(std::vector<Record>& records) {
+		std::sort(records.begin(), records.end(), [](Record const& a, Record const& b) {
+			auto const c = std::strncmp(a.slot, b.slot, sizeof(a.slot));
+			return c != 0 ? c < 0 : a.time_ns < b.time_ns;
+		});
+		records.erase(std::unique(records.begin(), records.end(), [](Record const& a, Record const& b) {
+			return a.time_ns == b.time_ns and std::strncmp(a.slot, b.slot, sizeof(a.slot)) == 0;
+		}), records.end());
+	}
+
+	Recorder::Recorder(char const* dir) : m_dir{ dir } {
+		if (::mkdir(dir, 0755) < 0 and errno != EEXIST)
+			return;
+		auto const path = m_dir + "/recorder.rec";
+		int const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return;
+		struct stat st{};
+		bool fresh = ::fstat(fd, &st) < 0 or static_cast<std::size_t>(st.st_size) != file_size;
+		if (fresh and (::ftruncate(fd, 0) < 0 or ::ftruncate(fd, file_size) < 0)) {
+			::close(fd);
+			return;
+		}
+		void* p = ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return;
+
+		m_header = static_cast<RecorderHeader*>(p);
+		m_records = reinterpret_cast<Record*>(m_header + 1);
+		// After a restart (or a crash) we simply continue the ring
+		if (fresh or std::memcmp(m_header->magic, magic, sizeof(magic)) != 0
+			or m_header->record_size != sizeof(Record) or m_header->capacity != capacity)
+		{
+			std::memset(p, 0, file_size);
+			std::memcpy(m_header->magic, magic, sizeof(magic));
+			m_header->record_size = sizeof(Record);
+			m_header->capacity = capacity;
+		}
+	}
+
+	Recorder::~Recorder() {
+		if (m_header != nullptr)
+			::munmap(m_header, file_size);
+	}
+
+	void Recorder::add(Record const& r) {
+		if (m_header == nullptr)
+			return;
+		m_records[m_header->head % m_header->capacity] = r;
+		++m_header->head;
+	}
+
+	bool Recorder::dump(std::uint8_t events) {
+		if (m_header == nullptr)
+			return false;
+		auto const now = std::chrono::steady_clock::now();
+		if (m_last_dump != std::chrono::steady_clock::time_point{} and now - m_last_dump < dump_interval)
+			return false;
+		m_last_dump = now;
+
+		auto const t = std::time(nullptr);
+		struct tm tm{};
+		::localtime_r(&t, &tm);
+		char stamp[32];
+		std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+		// Without strings, like the rest of a round this must not allocate
+		char path[PATH_MAX];
+		char tmp[PATH_MAX + 4];
+		std::snprintf(path, sizeof(path), "%s/dump-%s.rec", m_dir.c_str(), stamp);
+		std::snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+		// A dump is about to be needed after the machine went down hard,
+		// so it has to be on disk before we call it done.
+		int const fd = ::open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+		auto err = write_all(fd, m_header, file_size);
+		if (err == 0 and ::fdatasync(fd) < 0)
+			err = -errno;
+		::close(fd);
+		if (err == 0 and ::rename(tmp, path) < 0)
+			err = -errno;
+		if (err < 0) {
+			::unlink(tmp);
+			std::fprintf(stderr, "Could not write %s: %s\n", path, std::strerror(-err));
+			return false;
+		}
+		prune(m_dir);
+		char reason[64];
+		describe(events, reason, sizeof(reason));
+		std::printf("Recorded %s in %s\n", reason, path);
+		return true;
+	}
+}
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace powercap {
+
+	constexpr char const* recorder_dir = "/var/lib/powercap";
+	constexpr char const* recorder_file = "/var/lib/powercap/recorder.rec";
+
+	// What happened to a card in a round, a record may carry several
+	enum Event : std::uint8_t {
+		Applied = 1 << 0,	// we wrote a cap
+		Drift = 1 << 1,		// someone else changed the cap
+		WriteFailed = 1 << 2,
+		Reset = 1 << 3,		// it came back under another hwmon, e.g. after a gpu reset
+		Thermal = 1 << 4,	// close to temp1_crit
+		Spike = 1 << 5,		// drawing clearly more than the cap
+	};
+
+	// Drawing at least this share of the cap counts as running at it
+	constexpr double at_cap_factor = 0.95;
+
+	// The events that make us keep what led up to them
+	constexpr std::uint8_t dump_events = WriteFailed | Reset | Thermal | Spike;
+
+	// One sample of one card. This is the file format, new fields may only
+	// take the place of reserved.
+	struct Record {
+		std::int64_t time_ns = 0;	// CLOCK_REALTIME
+		char slot[16] = {};
+		std::uint64_t cap = 0;		// uW
+		std::uint32_t power = 0;	// mW
+		std::int32_t temp = 0;		// m°C
+		std::uint8_t busy = 0;		// percent
+		std::uint8_t events = 0;
+		std::uint8_t reserved[6] = {};
+	};
+	static_assert(sizeof(Record) == 48);
+
+	struct RecorderHeader {
+		char magic[8];
+		std::uint32_t record_size;
+		std::uint32_t capacity;
+		// Records written so far, the next one goes to head % capacity
+		std::uint64_t head;
+		std::uint8_t reserved[40];
+	};
+	static_assert(sizeof(RecorderHeader) == 64);
+
+	// Samples of a card further apart than this mean we were not running
+	constexpr std::int64_t max_gap_ns = 15 * 60 * 1000000000ll;
+
+	// Appends the records of a ring or dump file to out, oldest first.
+	// Returns a negative errno, -EINVAL if it is none of ours.
+	int load_records(char const* path, std::vector<Record>& out);
+
+	// Orders what got loaded per card and by time, and drops the duplicates
+	// of overlapping dumps
+	void merge_records(std::vector<Record>& records);
+
+	// The last few thousand records in a file mapped into memory, so they
+	// survive us crashing. When something goes wrong the ring is copied
+	// into a dump file next to it.
+	class Recorder {
+	public:
+		// The recorder stays disabled if the ring cannot be set up in dir
+		explicit Recorder(char const* dir);
+		~Recorder();
+
+		Recorder(Recorder const&) = delete;
+		Recorder& operator=(Recorder const&) = delete;
+
+		bool enabled() const {
+			return m_header != nullptr;
+		}
+
+		void add(Record const& r);
+
+		// Keeps a copy of the ring, unless we just did so. Returns true if
+		// a dump was written.
+		bool dump(std::uint8_t events);
+
+	private:
+		std::string m_dir;
+		RecorderHeader* m_header = nullptr;
+		Record* m_records = nullptr;
+		std::chrono::steady_clock::time_point m_last_dump;
+	};
+}
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Summarizes what the flight recorder saw. The samples of all files are
+ * merged per card and ordered by time, duplicates from overlapping dumps
+ * are dropped. The power of a sample is taken to last until the next sample
+ * of the card, unless that one is more than max_gap away, then we were not
+ * running in between.
+ */
+
+#include "report.hh"
+#include "recorder.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace powercap {
+
+	namespace {
+
+		constexpr std::array<std::string_view, 6> event_names = {
+			"applied",
+			"drift",
+			"write-failure",
+			"reset",
+			"thermal",
+			"spike",
+		};
+
+		struct Summary {
+			std::string slot;
+			std::size_t samples = 0;
+			double seconds = 0;
+			double joules = 0;
+			double at_cap_seconds = 0;
+			// In mW, for the percentiles
+			std::vector<std::uint32_t> power;
+			std::int32_t max_temp = 0;
+			unsigned cap_changes = 0;
+			std::array<unsigned, event_names.size()> events{};
+			// Joules by local day and hour
+			std::map<std::string, double> days;
+			std::map<std::string, double> hours;
+		};
+
+		std::string local_time(std::int64_t ns, char const* format) {
+			auto const t = static_cast<std::time_t>(ns / 1000000000);
+			struct tm tm{};
+			::localtime_r(&t, &tm);
+			char buf[32];
+			std::strftime(buf, sizeof(buf), format, &tm);
+			return buf;
+		}
+
+		// Of a sorted vector, in W
+		double percentile(std::vector<std::uint32_t> const& v, double p) {
+			if (v.empty())
+				return 0;
+			return v[static_cast<std::size_t>(p * (v.size() - 1) + 0.5)] / 1000.0;
+		}
+
+		std::vector<Summary> summarize(std::vector<Record>& records) {
+			merge_records(records);
+
+			std::vector<Summary> result;
+			Record const* prev = nullptr;
+			for (auto const& r : records) {
+				std::string_view const slot{ r.slot, strnlen(r.slot, sizeof(r.slot)) };
+				if (result.empty() or result.back().slot != slot) {
+					result.emplace_back();
+					result.back().slot = std::string{ slot };
+					prev = nullptr;
+				}
+				auto& s = result.back();
+				++s.samples;
+				s.power.push_back(r.power);
+				s.max_temp = std::max(s.max_temp, r.temp);
+				for (std::size_t i = 0; i < event_names.size(); ++i)
+					if (r.events & (1u << i))
+						++s.events[i];
+				if (prev != nullptr and prev->cap != r.cap)
+					++s.cap_changes;
+
+				if (prev != nullptr and r.time_ns - prev->time_ns <= max_gap_ns) {
+					auto const dt = (r.time_ns - prev->time_ns) / 1e9;
+					auto const j = prev->power / 1000.0 * dt;
+					s.seconds += dt;
+					s.joules += j;
+					if (prev->cap > 0 and prev->power * 1000.0 >= prev->cap * at_cap_factor)
+						s.at_cap_seconds += dt;
+					s.days[local_time(prev->time_ns, "%Y-%m-%d")] += j;
+					s.hours[local_time(prev->time_ns, "%Y-%m-%d %H:00")] += j;
+				}
+				prev = &r;
+			}
+			for (auto& s : result)
+				std::sort(s.power.begin(), s.power.end());
+			return result;
+		}
+
+		void print_table(std::vector<Summary> const& summaries) {
+			// °C takes two bytes but only one column
+			std::printf("%-14s %8s %8s %8s %7s %7s %7s %7s %7s %7s %8s %5s\n",
+				"card", "samples", "hours", "Wh", "avg W", "p50 W", "p95 W", "p99 W", "max W", "at cap", "max °C", "caps");
+			for (auto const& s : summaries) {
+				std::printf("%-14s %8zu %8.2f %8.1f %7.1f %7.1f %7.1f %7.1f %7.1f %6.1f%% %7.1f %5u\n",
+					s.slot.c_str(), s.samples, s.seconds / 3600, s.joules / 3600,
+					s.seconds > 0 ? s.joules / s.seconds : 0,
+					percentile(s.power, 0.5), percentile(s.power, 0.95), percentile(s.power, 0.99),
+					percentile(s.power, 1),
+					s.seconds > 0 ? 100 * s.at_cap_seconds / s.seconds : 0,
+					s.max_temp / 1000.0, s.cap_changes);
+			}
+			for (auto const& s : summaries) {
+				std::printf("\n%s\n", s.slot.c_str());
+				std::printf("  events:");
+				for (std::size_t i = 0; i < event_names.size(); ++i)
+					std::printf(" %s %u", event_names[i].data(), s.events[i]);
+				std::printf("\n");
+				for (auto const& [day, j] : s.days)
+					std::printf("  %-16s %8.1f Wh\n", day.c_str(), j / 3600);
+				for (auto const& [hour, j] : s.hours)
+					std::printf("  %-16s %8.1f Wh\n", hour.c_str(), j / 3600);
+			}
+		}
+
+		void print_json(std::vector<Summary> const& summaries) {
+			std::printf("{\"cards\":[");
+			for (std::size_t n = 0; n < summaries.size(); ++n) {
+				auto const& s = summaries[n];
+				std::printf("%s{\"slot\":\"%s\",\"samples\":%zu,\"seconds\":%.1f,\"energy_wh\":%.3f,"
+					"\"average_w\":%.2f,\"p50_w\":%.2f,\"p95_w\":%.2f,\"p99_w\":%.2f,\"max_w\":%.2f,"
+					"\"at_cap_seconds\":%.1f,\"max_temp_c\":%.1f,\"cap_changes\":%u,\"events\":{",
+					n > 0 ? "," : "", s.slot.c_str(), s.samples, s.seconds, s.joules / 3600,
+					s.seconds > 0 ? s.joules / s.seconds : 0,
+					percentile(s.power, 0.5), percentile(s.power, 0.95), percentile(s.power, 0.99),
+					percentile(s.power, 1), s.at_cap_seconds, s.max_temp / 1000.0, s.cap_changes);
+				for (std::size_t i = 0; i < event_names.size(); ++i)
+					std::printf("%s\"%s\":%u", i > 0 ? "," : "", event_names[i].data(), s.events[i]);
+				std::printf("},\"days\":{");
+				char const* sep = "";
+				for (auto const& [day, j] : s.days) {
+					std::printf("%s\"%s\":%.3f", sep, day.c_str(), j / 3600);
+					sep = ",";
+				}
+				std::printf("},\"hours\":{");
+				sep = "";
+				for (auto const& [hour, j] : s.hours) {
+					std::printf("%s\"%s\":%.3f", sep, hour.c_str(), j / 3600);
+					sep = ",";
+				}
+				std::printf("}}");
+			}
+			std::printf("]}\n");
+		}
+	}
+
+	int report(ReportOptions const& o) {
+		auto files = o.files;
+		if (files.empty())
+			files.push_back(recorder_file);
+
+		std::vector<Record> records;
+		for (auto const* f : files) {
+			if (auto const err = load_records(f, records); err < 0) {
+				std::fprintf(stderr, "Could not read %s: %s\n", f,
+					err == -EINVAL ? "not a recording" : std::strerror(-err));
+				return 1;
+			}
+		}
+
+		auto const summaries = summarize(records);
+		if (o.json)
+			print_json(summaries);
+		else
+			print_table(summaries);
+		return 0;
+	}
+}
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <vector>
+
+namespace powercap {
+
+	struct ReportOptions {
+		// Ring or dump files of the recorder, its ring if none is given
+		std::vector<char const*> files;
+		bool json = false;
+	};
+
+	// Summarizes the recorded samples per card, returns the exit code
+	int report(ReportOptions const& o);
+}
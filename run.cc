@@ -0,0 +1,637 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Energy accounting for a single command. Where the card offers the
+ * energy1_input counter the energy is the difference between start and
+ * end, otherwise power1_average is integrated over the samples. Peak draw
+ * and time at the cap always come from the samples.
+ *
+ * With a deadline or a throughput floor we also pick the caps while the
+ * command runs. The command reports its progress through a file holding a
+ * number that only grows, like the items or frames done so far. We start at
+ * the maximum to learn how fast it can go, then step down as long as the
+ * progress rate leaves enough slack, and up again when it does not.
+ *
+ * Optionally the fans are searched along with the caps. Leakage grows with
+ * the temperature, so a faster fan can lower the draw of the card, but it
+ * draws power itself. In the intervals the caps hold still the fan speed
+ * takes a step, and keeps going while the total draw falls. At the first
+ * sign of heat, or when someone else takes over the fan, it goes back to
+ * automatic control for the rest of the run.
+ */
+
+#include "run.hh"
+#include "autotune.hh"
+#include "expr.hh"
+#include "recorder.hh"
+#include "state.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		using clock = std::chrono::steady_clock;
+
+		constexpr std::chrono::milliseconds sample_interval{ 250 };
+
+		// How often the caps are reconsidered unless autotune measured how
+		// fast the cards respond, how far they move each time (as a share of
+		// the range) and how much faster than needed we want to be, the
+		// progress of a job is rarely linear.
+		constexpr std::chrono::seconds default_control_interval{ 10 };
+		constexpr double level_step = 0.1;
+		constexpr double rate_margin = 0.1;
+		// Weight of the latest progress rate
+		constexpr double rate_smoothing = 0.3;
+		// The throughput floor is relative to what the command made at the
+		// maximum, measured for this long and again after the interval.
+		constexpr std::chrono::seconds baseline_time{ 30 };
+		constexpr std::chrono::minutes baseline_interval{ 10 };
+		// The fan search never goes below a quarter of the fan's speed, and
+		// hands back to automatic control this close (m°C) to temp1_crit.
+		// Steps are in pwm1 units of 0-255 and halve down to the smallest
+		// whenever a step did not pay off, smaller gains are noise.
+		constexpr std::uint64_t fan_min_pwm = 64;
+		constexpr std::uint64_t fan_max_pwm = 255;
+		constexpr unsigned fan_first_step = 32;
+		constexpr unsigned fan_min_step = 4;
+		constexpr std::uint64_t fan_thermal_margin = 10000;
+		constexpr double fan_min_gain = 1;
+
+		volatile std::sig_atomic_t forward = 0;
+
+		void on_signal(int sig) {
+			forward = sig;
+		}
+
+		class Meter {
+		public:
+			explicit Meter(std::string const& hwmon)
+				: m_slot{ pci_slot_of(hwmon) }
+				, m_attrs{ hwmon }
+				, m_energy{ hwmon + "/energy1_input" }
+				, m_energy_start{ m_energy.read_uint64() }
+			{}
+
+			std::string const& slot() const {
+				return m_slot;
+			}
+
+			void sample(clock::time_point now) {
+				auto const w = m_attrs.sample(1u << Signal::Power)[Signal::Power];
+				auto const cap = m_attrs.cap();
+				if (m_samples > 0) {
+					auto const dt = std::chrono::duration<double>(now - m_last).count();
+					m_integrated += m_last_w * dt;
+					m_seconds += dt;
+					if (m_last_at_cap)
+						m_at_cap_seconds += dt;
+				}
+				m_last = now;
+				m_last_w = w;
+				m_last_at_cap = cap.has_value() and *cap > 0 and w * 1000000 >= *cap * at_cap_factor;
+				m_peak = std::max(m_peak, w);
+				++m_samples;
+			}
+
+			// Prefer the counter, it does not miss what happens between samples
+			double joules() {
+				if (m_energy_start.has_value()) {
+					auto const end = m_energy.read_uint64();
+					if (end.has_value() and *end >= *m_energy_start)
+						return (*end - *m_energy_start) / 1e6;
+				}
+				return m_integrated;
+			}
+
+			char const* source() const {
+				return m_energy_start.has_value() ? "energy1_input" : "estimate";
+			}
+
+			double peak() const {
+				return m_peak;
+			}
+
+			double at_cap_seconds() const {
+				return m_at_cap_seconds;
+			}
+
+		private:
+			std::string m_slot;
+			CardAttributes m_attrs;
+			Attribute m_energy;
+			std::optional<std::uint64_t> m_energy_start;
+			std::uint64_t m_samples = 0;
+			clock::time_point m_last;
+			double m_last_w = 0;
+			bool m_last_at_cap = false;
+			double m_integrated = 0;
+			double m_seconds = 0;
+			double m_peak = 0;
+			double m_at_cap_seconds = 0;
+		};
+
+		// Moves the caps of all cards together, as a level between their min
+		// (0) and their max (1). The cards are ours in the run state until
+		// they are restored, the watch daemon leaves them alone meanwhile
+		// and restores them itself if we get killed.
+		class Caps {
+		public:
+			Caps() {
+				for (auto const& hwmon : find_all_hwmon_base_paths()) {
+					CardAttributes attrs{ hwmon };
+					auto const min = attrs.cap_min();
+					auto const max = attrs.cap_max();
+					auto const cap = attrs.cap();
+					if (not min or not max or not cap or *min > *max)
+						continue;
+					// Another run, calibrate or autotune got there first
+					if (claim_card(hwmon, *cap) == -EBUSY) {
+						std::fprintf(stderr, "%s is in use by another powercap, leaving its limit alone\n",
+							pci_slot_of(hwmon).c_str());
+						continue;
+					}
+					m_cards.push_back(Card{ hwmon, *min, *max, *cap, *cap });
+				}
+			}
+
+			double level() const {
+				return m_level;
+			}
+
+			void set(double level) {
+				m_level = std::clamp(level, 0.0, 1.0);
+				for (auto& c : m_cards) {
+					auto const range = static_cast<double>(c.max - c.min);
+					auto const cap = std::max(c.min, whole_watts(c.min + static_cast<std::uint64_t>(range * m_level)));
+					write(c, cap);
+				}
+			}
+
+			void restore() {
+				for (auto& c : m_cards) {
+					write(c, c.original);
+					release_card(c.hwmon, static_cast<std::uint64_t>(::getpid()));
+				}
+			}
+
+			// The slowest card to respond sets the pace
+			clock::duration control_interval() const {
+				clock::duration result{};
+				for (auto const& c : m_cards) {
+					auto const d = dynamics_of(c.hwmon);
+					if (not d.has_value())
+						return default_control_interval;
+					result = std::max<clock::duration>(result, d->interval);
+				}
+				return m_cards.empty() ? clock::duration{ default_control_interval } : result;
+			}
+
+		private:
+			struct Card {
+				std::string hwmon;
+				std::uint64_t min;
+				std::uint64_t max;
+				std::uint64_t original;
+				std::uint64_t current;
+			};
+
+			static void write(Card& c, std::uint64_t cap) {
+				if (cap == c.current or set_power_cap(c.hwmon, cap) < 0)
+					return;
+				c.current = cap;
+				record_cap(c.hwmon, cap);
+			}
+
+			std::vector<Card> m_cards;
+			double m_level = 1;
+		};
+
+		// The number in the progress file and how fast it grows
+		class Progress {
+		public:
+			explicit Progress(char const* path) : m_path{ path } {}
+
+			// Returns false as long as there is no rate yet
+			bool update(clock::time_point now) {
+				auto const s = read_string_from(m_path);
+				if (not s.has_value())
+					return false;
+				char* end = nullptr;
+				auto const v = std::strtod(s->c_str(), &end);
+				if (end == s->c_str())
+					return false;
+				if (m_last != clock::time_point{}) {
+					auto const dt = std::chrono::duration<double>(now - m_last).count();
+					auto const rate = dt > 0 ? (v - m_value) / dt : 0;
+					m_rate = m_samples == 0 ? rate : m_rate + rate_smoothing * (rate - m_rate);
+					++m_samples;
+				}
+				m_last = now;
+				m_value = v;
+				return m_samples > 0;
+			}
+
+			// Forget the rate, e.g. when it is measured under other caps
+			void restart() {
+				m_samples = 0;
+				m_rate = 0;
+			}
+
+			double value() const {
+				return m_value;
+			}
+
+			// Smoothed, per second
+			double rate() const {
+				return m_rate;
+			}
+
+		private:
+			char const* m_path;
+			clock::time_point m_last;
+			double m_value = 0;
+			double m_rate = 0;
+			unsigned m_samples = 0;
+		};
+
+		void move(Caps& caps, double level, char const* why) {
+			level = std::clamp(level, 0.0, 1.0);
+			if (level == caps.level())
+				return;
+			std::fprintf(stderr, "%s, %s the power limits to %.0f%% of their range\n",
+				why, level < caps.level() ? "lowering" : "raising", level * 100);
+			caps.set(level);
+		}
+
+		// Steps the level towards the lowest one that still finishes in time
+		class Deadline {
+		public:
+			explicit Deadline(RunOptions const& o) : m_o{ o } {}
+
+			void update(Caps& caps, Progress const& p) {
+				auto const done = std::clamp(p.value() / m_o.total, 0.0, 1.0);
+				auto const rate = p.rate() / m_o.total;
+				if (done >= 1 or rate <= 0)
+					return;
+
+				// Past the deadline all we can do is hurry
+				auto const left = std::difftime(m_o.deadline, std::time(nullptr));
+				auto const needed = left > 0 ? (1 - done) / left : 1;
+				auto level = caps.level();
+				if (rate < needed * (1 + rate_margin))
+					level += level_step;
+				else if (rate > needed * (1 + 2 * rate_margin))
+					level -= level_step;
+				char why[64];
+				std::snprintf(why, sizeof(why), "%.0f%% done, %.1fmin left", done * 100, left / 60);
+				move(caps, level, why);
+			}
+
+		private:
+			RunOptions const& m_o;
+		};
+
+		// Steps the level towards the lowest one that keeps the throughput
+		// above the floor. What the command makes at the maximum is measured
+		// first, and again every now and then since jobs change phases.
+		class Floor {
+		public:
+			explicit Floor(double floor) : m_floor{ floor } {}
+
+			void update(Caps& caps, Progress& p, clock::time_point now) {
+				if (m_baseline == 0) {
+					if (m_measure_until == clock::time_point{})
+						m_measure_until = now + baseline_time;
+					if (now < m_measure_until or p.rate() <= 0)
+						return;
+					m_baseline = p.rate();
+					m_next_baseline = now + baseline_interval;
+					std::fprintf(stderr, "%.2f/s at the maximum power limits\n", m_baseline);
+				} else if (now >= m_next_baseline) {
+					move(caps, 1, "Measuring the throughput again");
+					p.restart();
+					m_baseline = 0;
+					m_measure_until = now + baseline_time;
+					return;
+				}
+
+				auto const floor = m_baseline * m_floor;
+				auto level = caps.level();
+				if (p.rate() < floor)
+					level += level_step;
+				else if (p.rate() > floor * (1 + rate_margin))
+					level -= level_step;
+				char why[64];
+				std::snprintf(why, sizeof(why), "%.2f/s of at least %.2f/s", p.rate(), floor);
+				move(caps, level, why);
+			}
+
+			// While the baseline is measured nothing else may move
+			bool measuring() const {
+				return m_baseline == 0;
+			}
+
+		private:
+			double const m_floor;
+			double m_baseline = 0;
+			clock::time_point m_measure_until;
+			clock::time_point m_next_baseline;
+		};
+
+		// Searches the fan speed of each card with the lowest total draw,
+		// while the caps take care of the throughput. The fan's own draw is
+		// not measured, it is taken to grow with the cube of its speed up to
+		// fan_watts at full speed.
+		class Fans {
+		public:
+			explicit Fans(double fan_watts) : m_fan_watts{ fan_watts } {
+				for (auto const& hwmon : find_all_hwmon_base_paths()) {
+					Fan f{ hwmon };
+					auto const enable = read_dec_uint64_value_from(f.enable_path);
+					auto const pwm = read_dec_uint64_value_from(f.pwm_path);
+					// Without temp1_crit we could not tell when to stop
+					if (not enable or not pwm or not f.attrs.temp_crit())
+						continue;
+					if (claim_fan(hwmon) == -EBUSY) {
+						std::fprintf(stderr, "%s is in use by another powercap, leaving its fan alone\n",
+							pci_slot_of(hwmon).c_str());
+						continue;
+					}
+					f.original_enable = *enable;
+					f.original_pwm = *pwm;
+					f.pwm = std::clamp(*pwm, fan_min_pwm, fan_max_pwm);
+					if (write_dec_uint64_value_to(f.enable_path, pwm_manual) < 0
+						or write_dec_uint64_value_to(f.pwm_path, f.pwm) < 0)
+					{
+						write_dec_uint64_value_to(f.enable_path, f.original_enable);
+						continue;
+					}
+					std::fprintf(stderr, "Searching the fan speed of %s along with the caps\n",
+						pci_slot_of(hwmon).c_str());
+					m_fans.push_back(std::move(f));
+				}
+			}
+
+			// Every sample, also to notice heat right away
+			void sample() {
+				for (auto& f : m_fans) {
+					if (not f.active)
+						continue;
+					auto const s = f.attrs.sample((1u << Signal::Power) | (1u << Signal::Temp));
+					auto const temp = static_cast<std::uint64_t>(std::max(s[Signal::Temp], 0.0) * 1000);
+					if (s[Signal::Temp] <= 0 or temp + fan_thermal_margin >= *f.attrs.temp_crit()) {
+						give_back(f, "it runs hot");
+						continue;
+					}
+					f.power += s[Signal::Power];
+					++f.samples;
+				}
+			}
+
+			// The caps moved, what was drawn meanwhile says nothing about the fan
+			void discard() {
+				for (auto& f : m_fans) {
+					f.power = 0;
+					f.samples = 0;
+					f.cost = 0;
+				}
+			}
+
+			// A step per control interval in which the caps held still
+			void update() {
+				for (auto& f : m_fans) {
+					if (not f.active or f.samples == 0)
+						continue;
+					if (read_dec_uint64_value_from(f.enable_path) != pwm_manual) {
+						f.active = false;
+						std::fprintf(stderr, "Someone else took over the fan of %s, leaving it alone\n",
+							pci_slot_of(f.attrs.hwmon()).c_str());
+						continue;
+					}
+					auto const speed = static_cast<double>(f.pwm) / fan_max_pwm;
+					auto const cost = f.power / f.samples + m_fan_watts * speed * speed * speed;
+					f.power = 0;
+					f.samples = 0;
+					if (f.cost > 0 and cost > f.cost - fan_min_gain) {
+						// Did not pay off, back to where we were and try the
+						// other direction with a smaller step
+						set(f, static_cast<std::int64_t>(f.previous));
+						f.direction = -f.direction;
+						f.step = std::max(f.step / 2, fan_min_step);
+						f.cost = 0;
+						continue;
+					}
+					f.cost = cost;
+					auto const next = static_cast<std::int64_t>(f.pwm) + f.direction * static_cast<int>(f.step);
+					if (next < static_cast<std::int64_t>(fan_min_pwm) or next > static_cast<std::int64_t>(fan_max_pwm)) {
+						f.direction = -f.direction;
+						continue;
+					}
+					f.previous = f.pwm;
+					set(f, next);
+				}
+			}
+
+			// Also the fans handed back to automatic control meanwhile
+			void restore() {
+				for (auto& f : m_fans) {
+					if (f.original_enable == pwm_manual)
+						write_dec_uint64_value_to(f.pwm_path, f.original_pwm);
+					write_dec_uint64_value_to(f.enable_path, f.original_enable);
+				}
+			}
+
+		private:
+			struct Fan {
+				explicit Fan(std::string const& hwmon)
+					: attrs{ hwmon }
+					, enable_path{ hwmon + "/pwm1_enable" }
+					, pwm_path{ hwmon + "/pwm1" }
+				{}
+
+				CardAttributes attrs;
+				std::string enable_path;
+				std::string pwm_path;
+				std::uint64_t original_enable = pwm_automatic;
+				std::uint64_t original_pwm = 0;
+				std::uint64_t pwm = 0;
+				std::uint64_t previous = 0;
+				unsigned step = fan_first_step;
+				// Faster fans first, that is the safe side
+				int direction = 1;
+				// Average draw plus fan in the last interval, 0 if unknown
+				double cost = 0;
+				double power = 0;
+				unsigned samples = 0;
+				bool active = true;
+			};
+
+			void set(Fan& f, std::int64_t pwm) {
+				f.pwm = static_cast<std::uint64_t>(std::clamp<std::int64_t>(pwm, fan_min_pwm, fan_max_pwm));
+				if (write_dec_uint64_value_to(f.pwm_path, f.pwm) < 0)
+					give_back(f, "pwm1 could not be written");
+			}
+
+			// Automatic control for the rest of the run
+			void give_back(Fan& f, char const* why) {
+				f.active = false;
+				write_dec_uint64_value_to(f.enable_path, pwm_automatic);
+				std::fprintf(stderr, "Back to automatic fan control on %s, %s\n",
+					pci_slot_of(f.attrs.hwmon()).c_str(), why);
+			}
+
+			double const m_fan_watts;
+			std::vector<Fan> m_fans;
+		};
+
+		int exit_code_of(int status) {
+			if (WIFEXITED(status))
+				return WEXITSTATUS(status);
+			if (WIFSIGNALED(status))
+				return 128 + WTERMSIG(status);
+			return 1;
+		}
+
+		void write_json(char const* path, std::vector<Meter>& meters, double seconds, int exit_code) {
+			FILE* f = std::fopen(path, "we");
+			if (f == nullptr) {
+				std::fprintf(stderr, "Could not write %s: %s\n", path, std::strerror(errno));
+				return;
+			}
+			std::fprintf(f, "{\"seconds\":%.3f,\"exit_code\":%d,\"cards\":[", seconds, exit_code);
+			for (std::size_t i = 0; i < meters.size(); ++i) {
+				auto& m = meters[i];
+				auto const j = m.joules();
+				std::fprintf(f, "%s{\"slot\":\"%s\",\"joules\":%.1f,\"average_w\":%.2f,\"peak_w\":%.2f,"
+					"\"at_cap_seconds\":%.2f,\"source\":\"%s\"}",
+					i > 0 ? "," : "", m.slot().c_str(), j, seconds > 0 ? j / seconds : 0, m.peak(),
+					m.at_cap_seconds(), m.source());
+			}
+			std::fprintf(f, "]}\n");
+			std::fclose(f);
+		}
+	}
+
+	int run(RunOptions const& o) {
+		std::vector<Meter> meters;
+		for (auto const& hwmon : find_all_hwmon_base_paths())
+			meters.emplace_back(hwmon);
+
+		std::optional<Caps> caps;
+		std::optional<Progress> progress;
+		std::optional<Deadline> deadline;
+		std::optional<Floor> floor;
+		if (o.deadline != 0)
+			deadline.emplace(o);
+		if (o.floor > 0)
+			floor.emplace(o.floor);
+		if (deadline or floor) {
+			caps.emplace();
+			caps->set(1);
+			progress.emplace(o.progress);
+		}
+		std::optional<Fans> fans;
+		if (caps and o.fan > 0)
+			fans.emplace(o.fan);
+
+		auto const start = clock::now();
+		for (auto& m : meters)
+			m.sample(start);
+
+		pid_t const pid = ::fork();
+		if (pid < 0) {
+			std::fprintf(stderr, "Could not fork: %s\n", std::strerror(errno));
+			if (fans)
+				fans->restore();
+			if (caps)
+				caps->restore();
+			return 1;
+		}
+		if (pid == 0) {
+			::execvp(o.argv[0], o.argv);
+			std::fprintf(stderr, "Could not execute %s: %s\n", o.argv[0], std::strerror(errno));
+			::_exit(127);
+		}
+
+		// The command decides what to do about them, we wait for it
+		struct sigaction sa{};
+		sa.sa_handler = on_signal;
+		::sigaction(SIGINT, &sa, nullptr);
+		::sigaction(SIGTERM, &sa, nullptr);
+		::sigaction(SIGHUP, &sa, nullptr);
+
+		int status = 0;
+		clock::duration const control_interval = caps ? caps->control_interval() : default_control_interval;
+		auto next_control = clock::now() + control_interval;
+		for (;;) {
+			auto const r = ::waitpid(pid, &status, WNOHANG);
+			if (r == pid or (r < 0 and errno != EINTR))
+				break;
+			if (forward != 0) {
+				::kill(pid, forward);
+				forward = 0;
+			}
+			struct timespec ts{ 0, std::chrono::nanoseconds{ sample_interval }.count() };
+			::nanosleep(&ts, nullptr);
+			auto const now = clock::now();
+			for (auto& m : meters)
+				m.sample(now);
+			if (fans)
+				fans->sample();
+			if (progress and now >= next_control) {
+				next_control = now + control_interval;
+				if (not progress->update(now))
+					continue;
+				auto const level = caps->level();
+				if (deadline)
+					deadline->update(*caps, *progress);
+				if (floor)
+					floor->update(*caps, *progress, now);
+				if (fans and (caps->level() != level or (floor and floor->measuring())))
+					fans->discard();
+				else if (fans)
+					fans->update();
+			}
+		}
+		if (fans)
+			fans->restore();
+		if (caps)
+			caps->restore();
+
+		auto const end = clock::now();
+		for (auto& m : meters)
+			m.sample(end);
+		auto const seconds = std::chrono::duration<double>(end - start).count();
+		auto const exit_code = exit_code_of(status);
+
+		for (auto& m : meters) {
+			auto const j = m.joules();
+			std::fprintf(stderr, "%s: %.1fJ in %.1fs, %.1fW average, %.1fW peak, %.1fs at the cap\n",
+				m.slot().c_str(), j, seconds, seconds > 0 ? j / seconds : 0, m.peak(), m.at_cap_seconds());
+		}
+		if (o.json != nullptr)
+			write_json(o.json, meters, seconds, exit_code);
+		return exit_code;
+	}
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <ctime>
+
+namespace powercap {
+
+	struct RunOptions {
+		// The command and its arguments, terminated by nullptr
+		char* const* argv = nullptr;
+		// Also write the report as JSON to this file
+		char const* json = nullptr;
+		// The command writes how far it got into this file, a number
+		// growing up to total
+		char const* progress = nullptr;
+		double total = 1;
+		// Keep the caps as low as possible while still reaching total by
+		// then, 0 if there is no deadline
+		std::time_t deadline = 0;
+		// Keep the caps as low as possible while the progress still grows
+		// at this share of its rate at the maximum caps, 0 if not
+		double floor = 0;
+		// Draw of a card's fan at full speed in W. Above 0 the fan speed is
+		// searched along with the caps, for the lowest total draw.
+		double fan = 0;
+	};
+
+	// Runs the command and reports the energy the cards used meanwhile,
+	// with a deadline or a floor it also chooses the caps (and maybe fan
+	// speeds). Returns the exit code of the command.
+	int run(RunOptions const& o);
+}
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * The state file is plain text, one card per line:
+ *
+ * primary 0000:03:00.0
+ * card 0000:03:00.0 /sys/class/drm/card1 /sys/.../hwmon/hwmon4 1234 1700000000000000000 300000000 0 0 0
+ *
+ * The last three numbers are the pid of the owner, the cap to go back to
+ * and whether it took over the fan. Files written before they existed end
+ * after the cap.
+ *
+ * Lines we do not understand are dropped, the worst outcome of a broken
+ * file is a rescan.
+ */
+
+#include "state.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		constexpr char const* state_dir = "/run/powercap";
+		constexpr char const* state_file = "/run/powercap/state";
+		constexpr char const* state_tmp_file = "/run/powercap/state.tmp";
+		constexpr char const* lock_file = "/run/powercap/lock";
+
+		std::uint64_t mtime_ns_of(struct stat const& st) {
+			return static_cast<std::uint64_t>(st.st_mtim.tv_sec) * 1000000000u + st.st_mtim.tv_nsec;
+		}
+
+		void parse_line(std::string_view line, RunState& s) {
+			auto const kind = next_token(line);
+			if (kind == "primary") {
+				s.primary = std::string{ next_token(line) };
+				return;
+			}
+			if (kind != "card")
+				return;
+			CardState c;
+			c.slot = std::string{ next_token(line) };
+			c.card = std::string{ next_token(line) };
+			if (c.card == "-")
+				c.card.clear();
+			c.hwmon = std::string{ next_token(line) };
+			if (c.slot.empty() or c.hwmon.empty())
+				return;
+			if (not to_uint64(next_token(line), c.ino)
+				or not to_uint64(next_token(line), c.mtime_ns)
+				or not to_uint64(next_token(line), c.cap))
+				return;
+			if (auto const pid = next_token(line); not pid.empty()
+				and (not to_uint64(pid, c.owner.pid) or not to_uint64(next_token(line), c.owner.cap)
+					or not to_uint64(next_token(line), c.owner.fan)))
+				return;
+			s.cards.push_back(std::move(c));
+		}
+
+		// Load, change a single card and save, under the lock. The card is
+		// added if we did not know it yet. Nothing is saved if change fails.
+		template <typename F>
+		int change_card(std::string const& hwmon, F change) {
+			RunStateLock const lock;
+			auto state = load_run_state();
+			CardState c;
+			if (auto const* known = state.find(pci_slot_of(hwmon)))
+				c = *known;
+			else
+				c.slot = pci_slot_of(hwmon);
+			c.hwmon = hwmon;
+			if (c.slot.empty() or not stamp(c))
+				return -ENODEV;
+			if (auto const err = change(c); err < 0)
+				return err;
+			state.update(c);
+			return save_run_state(state);
+		}
+	}
+
+	RunStateLock::RunStateLock() {
+		if (::mkdir(state_dir, 0755) < 0 and errno != EEXIST)
+			return;
+		m_fd = ::open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (m_fd >= 0)
+			::flock(m_fd, LOCK_EX);
+	}
+
+	RunStateLock::~RunStateLock() {
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	CardState* RunState::find(std::string_view slot) {
+		for (auto& c : cards)
+			if (c.slot == slot)
+				return &c;
+		return nullptr;
+	}
+
+	CardState const* RunState::find(std::string_view slot) const {
+		for (auto const& c : cards)
+			if (c.slot == slot)
+				return &c;
+		return nullptr;
+	}
+
+	CardState& RunState::update(CardState const& c) {
+		if (auto* existing = find(c.slot)) {
+			*existing = c;
+			return *existing;
+		}
+		cards.push_back(c);
+		return cards.back();
+	}
+
+	RunState load_run_state() {
+		RunState s;
+		auto const content = read_file(state_file);
+		if (not content.has_value())
+			return s;
+
+		for_each_line(*content, [&s](std::string_view line) { parse_line(line, s); });
+		return s;
+	}
+
+	int save_run_state(RunState const& s) {
+		if (::mkdir(state_dir, 0755) < 0 and errno != EEXIST)
+			return -errno;
+
+		std::string content;
+		if (not s.primary.empty())
+			content += "primary " + s.primary + "\n";
+		for (auto const& c : s.cards) {
+			char nums[128];
+			std::snprintf(nums, sizeof(nums), " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+				c.ino, c.mtime_ns, c.cap, c.owner.pid, c.owner.cap, c.owner.fan);
+			content += "card " + c.slot + " " + (c.card.empty() ? "-" : c.card) + " " + c.hwmon + nums;
+		}
+
+		// Write a new file and rename it, so a concurrent udev run never sees
+		// a half written state
+		int fd = ::open(state_tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -errno;
+		auto const n = ::write(fd, content.data(), content.size());
+		int err = n < 0 ? -errno : 0;
+		::close(fd);
+		if (err == 0 and ::rename(state_tmp_file, state_file) < 0)
+			err = -errno;
+		return err;
+	}
+
+	int record_cap(std::string const& hwmon, std::uint64_t cap) {
+		return change_card(hwmon, [cap](CardState& c) {
+			c.cap = cap;
+			return 0;
+		});
+	}
+
+	int claim_card(std::string const& hwmon, std::uint64_t cap) {
+		auto const pid = static_cast<std::uint64_t>(::getpid());
+		return change_card(hwmon, [pid, cap](CardState& c) {
+			if (c.owner.pid != pid and owner_alive(c))
+				return -EBUSY;
+			c.owner = {};
+			c.owner.pid = pid;
+			c.owner.cap = cap;
+			// The daemon only picks up cards with a cap
+			if (c.cap == 0)
+				c.cap = cap;
+			return 0;
+		});
+	}
+
+	int claim_fan(std::string const& hwmon) {
+		auto const pid = static_cast<std::uint64_t>(::getpid());
+		return change_card(hwmon, [pid](CardState& c) {
+			if (c.owner.pid != pid and owner_alive(c))
+				return -EBUSY;
+			c.owner.pid = pid;
+			c.owner.fan = 1;
+			return 0;
+		});
+	}
+
+	int release_card(std::string const& hwmon, std::uint64_t pid) {
+		return change_card(hwmon, [pid](CardState& c) {
+			if (c.owner.pid != pid)
+				return -EPERM;
+			c.owner = {};
+			return 0;
+		});
+	}
+
+	bool owner_alive(CardState const& c) {
+		if (c.owner.pid == 0)
+			return false;
+		// EPERM means it runs, just not as us
+		return ::kill(static_cast<pid_t>(c.owner.pid), 0) == 0 or errno == EPERM;
+	}
+
+	bool stamp(CardState& c) {
+		struct stat st;
+		if (::stat(c.hwmon.c_str(), &st) < 0)
+			return false;
+		c.ino = st.st_ino;
+		c.mtime_ns = mtime_ns_of(st);
+		return true;
+	}
+
+	bool is_valid(CardState const& c) {
+		struct stat st;
+		return ::stat(c.hwmon.c_str(), &st) == 0 and st.st_ino == c.ino and mtime_ns_of(st) == c.mtime_ns;
+	}
+
+	std::uint64_t run_state_generation() {
+		struct stat st;
+		if (::stat(state_file, &st) < 0)
+			return 0;
+		// The file only ever gets replaced, so a new inode means new content
+		return st.st_ino ^ mtime_ns_of(st);
+	}
+}
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace powercap {
+
+	// Another process that changed the card for a while, e.g. powercap run.
+	// The daemon leaves the card alone while it lives and puts it back
+	// once it is gone, it may get killed before it can do that itself.
+	struct Owner {
+		std::uint64_t pid = 0;
+		// The cap in uW to go back to, 0 if none
+		std::uint64_t cap = 0;
+		// 1 if it took over the fan, which goes back to automatic control
+		std::uint64_t fan = 0;
+	};
+
+	// What we learned about a card on a previous run. The hwmon inode and
+	// mtime change when the driver gets reloaded, so they tell us whether
+	// the paths can still be trusted.
+	struct CardState {
+		std::string slot;
+		std::string card;
+		std::string hwmon;
+		std::uint64_t ino = 0;
+		std::uint64_t mtime_ns = 0;
+		// The last power1_cap we applied in uW, 0 if none
+		std::uint64_t cap = 0;
+		// Nobody but the daemon if pid is 0
+		Owner owner;
+	};
+
+	// Resolved topology and the caps we applied, kept in /run so it is
+	// gone after a reboot but survives our own restarts.
+	struct RunState {
+		std::string primary;
+		std::vector<CardState> cards;
+
+		CardState* find(std::string_view slot);
+		CardState const* find(std::string_view slot) const;
+		CardState& update(CardState const& c);
+	};
+
+	// Serializes the load/modify/save cycle between concurrent invocations,
+	// udev happily runs us for several cards at once.
+	class RunStateLock {
+	public:
+		RunStateLock();
+		~RunStateLock();
+
+		RunStateLock(RunStateLock const&) = delete;
+		RunStateLock& operator=(RunStateLock const&) = delete;
+
+	private:
+		int m_fd = -1;
+	};
+
+	RunState load_run_state();
+	int save_run_state(RunState const& s);
+
+	// Store the cap written to the hwmon, keeping what else we know about
+	// the card. Takes the lock itself.
+	int record_cap(std::string const& hwmon, std::uint64_t cap);
+
+	// Make the calling process the owner of the card, cap is what to go
+	// back to. Takes the lock itself. Fails with -EBUSY while another
+	// owner still runs.
+	int claim_card(std::string const& hwmon, std::uint64_t cap);
+
+	// Make the calling process the owner of the fan as well
+	int claim_fan(std::string const& hwmon);
+
+	// Once things are back the way the owner found them, only if pid still
+	// owns the card
+	int release_card(std::string const& hwmon, std::uint64_t pid);
+
+	// Whether the card has an owner and it still runs
+	bool owner_alive(CardState const& c);
+
+	// Record inode and mtime of the hwmon, returns false if it is gone
+	bool stamp(CardState& c);
+
+	// Whether the cached paths still point to the same device
+	bool is_valid(CardState const& c);
+
+	// Changes whenever the state file got rewritten, 0 if there is none
+	std::uint64_t run_state_generation();
+}
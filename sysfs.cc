@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		// Returns the first hwmonN entry below the given directory
+		std::string find_first_hwmon_in(std::string const& base_path) {
+			DIR* dir = ::opendir(base_path.c_str());
+			if (dir == nullptr)
+				return "";
+			std::string result;
+			while (auto const* dir_entry = ::readdir(dir)) {
+				std::string_view const name{ dir_entry->d_name };
+				if (not starts_with(name, "hwmon"))
+					continue;
+				result = base_path + "/" + std::string{ name };
+				break;
+			}
+			::closedir(dir);
+			return result;
+		}
+	}
+
+	std::string_view next_token(std::string_view& line) {
+		auto const start = line.find_first_not_of(' ');
+		if (start == line.npos) {
+			line = {};
+			return {};
+		}
+		line.remove_prefix(start);
+		auto const end = line.find(' ');
+		auto const token = line.substr(0, end);
+		line.remove_prefix(end == line.npos ? line.size() : end);
+		return token;
+	}
+
+	bool to_uint64(std::string_view s, std::uint64_t& v) {
+		if (s.empty())
+			return false;
+		std::uint64_t r = 0;
+		for (auto c : s) {
+			if (c < '0' or c > '9')
+				return false;
+			r = r * 10 + static_cast<std::uint64_t>(c - '0');
+		}
+		v = r;
+		return true;
+	}
+
+	bool to_double(std::string_view s, double& v) {
+		if (s.empty())
+			return false;
+		std::string const str{ s };
+		char* end = nullptr;
+		auto const r = std::strtod(str.c_str(), &end);
+		if (end != str.c_str() + str.size())
+			return false;
+		v = r;
+		return true;
+	}
+
+	std::uint64_t whole_watts(std::uint64_t uw) {
+		return uw / 1000000 * 1000000;
+	}
+
+	std::optional<std::string> read_string_from(std::string const& p) {
+		int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return {};
+		char buf[64];
+		auto n = ::read(fd, buf, sizeof(buf) - 1);
+		::close(fd);
+		if (n < 0)
+			return {};
+		std::string_view s{ buf, static_cast<std::size_t>(n) };
+		if (auto nl = s.find('\n'); nl != s.npos)
+			s = s.substr(0, nl);
+		return std::string{ s };
+	}
+
+	std::optional<std::string> read_file(std::string const& p) {
+		int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return {};
+		std::string content;
+		char buf[4096];
+		ssize_t n;
+		while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+			content.append(buf, static_cast<std::size_t>(n));
+		::close(fd);
+		if (n < 0)
+			return {};
+		return content;
+	}
+
+	std::optional<std::uint64_t> read_dec_uint64_value_from(std::string const& p) {
+		auto v = read_string_from(p);
+		if (not v.has_value())
+			return {};
+		char* end = nullptr;
+		errno = 0;
+		auto const r = std::strtoull(v->c_str(), &end, 10);
+		if (errno != 0 or end == v->c_str() or *end != '\0') {
+			std::fprintf(stderr, "Unable to convert %s to unsigned value\n", v->c_str());
+			return {};
+		}
+		return r;
+	}
+
+	int write_dec_uint64_value_to(std::string const& p, std::uint64_t v) {
+		int fd = ::open(p.c_str(), O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+		char buf[24];
+		auto const len = std::snprintf(buf, sizeof(buf), "%" PRIu64, v);
+		// The driver only sees the value once the write syscall returns, so
+		// this also covers the time the SMU needs to accept it.
+		auto const n = ::write(fd, buf, len);
+		int const err = n < 0 ? -errno : 0;
+		::close(fd);
+		return err;
+	}
+
+	int write_dec_uint64_value_to(std::string const& p, std::optional<std::uint64_t> const& v) {
+		if (not v.has_value())
+			return -ENODATA;
+		return write_dec_uint64_value_to(p, v.value());
+	}
+
+	Attribute::~Attribute() {
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	Attribute::Attribute(Attribute&& o) noexcept : m_path{ std::move(o.m_path) }, m_fd{ o.m_fd } {
+		o.m_fd = -1;
+	}
+
+	Attribute& Attribute::operator=(Attribute&& o) noexcept {
+		if (this != &o) {
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_path = std::move(o.m_path);
+			m_fd = o.m_fd;
+			o.m_fd = -1;
+		}
+		return *this;
+	}
+
+	std::optional<std::string_view> Attribute::read(char* buf, std::size_t size) {
+		if (m_fd < 0)
+			m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (m_fd < 0)
+			return {};
+		// sysfs regenerates the content for every read at offset 0
+		auto const n = ::pread(m_fd, buf, size, 0);
+		if (n < 0) {
+			// The device is gone, try to open it again next time
+			::close(m_fd);
+			m_fd = -1;
+			return {};
+		}
+		return std::string_view{ buf, static_cast<std::size_t>(n) };
+	}
+
+	std::optional<std::string_view> Attribute::read_line() {
+		auto s = read(m_buf, sizeof(m_buf) - 1);
+		if (not s.has_value())
+			return {};
+		if (auto nl = s->find('\n'); nl != s->npos)
+			s = s->substr(0, nl);
+		return s;
+	}
+
+	std::optional<std::uint64_t> Attribute::read_uint64() {
+		auto const s = read_line();
+		if (not s.has_value() or not is_digits(*s))
+			return {};
+		std::uint64_t v = 0;
+		for (auto c : *s)
+			v = v * 10 + static_cast<std::uint64_t>(c - '0');
+		return v;
+	}
+
+	int set_power_cap(std::string const& hwmon, std::optional<std::uint64_t> const& uw) {
+		auto const p = hwmon + "/power1_cap";
+		if (uw.has_value())
+			std::printf("Trying to write %" PRIu64 " to %s...\n", *uw / 1000, p.c_str());
+		return write_dec_uint64_value_to(p, uw);
+	}
+
+	std::string find_card_base_path() {
+		std::string const base_path{ "/sys/class/drm" };
+		DIR* dir = ::opendir(base_path.c_str());
+		if (dir == nullptr)
+			return "";
+		std::string result;
+		while (auto const* dir_entry = ::readdir(dir)) {
+			std::string_view const name{ dir_entry->d_name };
+			// Skip the connectors (card1-DP-1, ...), only cardN has a device
+			if (not starts_with(name, "card") or not is_digits(name.substr(4)))
+				continue;
+			result = base_path + "/" + std::string{ name };
+			break;
+		}
+		::closedir(dir);
+		return result;
+	}
+
+	std::string find_hwmon_base_path(std::string const& p) {
+		return find_first_hwmon_in(p + "/device/hwmon");
+	}
+
+	std::vector<std::string> find_all_hwmon_base_paths() {
+		std::string const base_path{ "/sys/class/drm" };
+		std::vector<std::string> result;
+		DIR* dir = ::opendir(base_path.c_str());
+		if (dir == nullptr)
+			return result;
+		while (auto const* dir_entry = ::readdir(dir)) {
+			std::string_view const name{ dir_entry->d_name };
+			if (not starts_with(name, "card") or not is_digits(name.substr(4)))
+				continue;
+			auto hwmon = find_hwmon_base_path(base_path + "/" + std::string{ name });
+			if (hwmon.empty() or ::access((hwmon + "/power1_cap").c_str(), F_OK) != 0)
+				continue;
+			result.push_back(std::move(hwmon));
+		}
+		::closedir(dir);
+		return result;
+	}
+
+	std::string find_hwmon_base_path_for_device(std::string const& p) {
+		if (::access((p + "/power1_cap").c_str(), F_OK) == 0)
+			return p;
+		if (::access((p + "/device/hwmon").c_str(), F_OK) == 0)
+			return find_hwmon_base_path(p);
+		return find_first_hwmon_in(p + "/hwmon");
+	}
+
+	std::string pci_slot_of(std::string const& hwmon) {
+		char buf[PATH_MAX];
+		auto const n = ::readlink((hwmon + "/device").c_str(), buf, sizeof(buf) - 1);
+		if (n <= 0)
+			return "";
+		std::string_view const target{ buf, static_cast<std::size_t>(n) };
+		auto const slash = target.rfind('/');
+		return std::string{ slash == target.npos ? target : target.substr(slash + 1) };
+	}
+
+	int card_index_of(std::string const& hwmon) {
+		DIR* dir = ::opendir((hwmon + "/device/drm").c_str());
+		if (dir == nullptr)
+			return -1;
+		int result = -1;
+		while (auto const* dir_entry = ::readdir(dir)) {
+			std::string_view const name{ dir_entry->d_name };
+			if (not starts_with(name, "card") or not is_digits(name.substr(4)))
+				continue;
+			result = std::atoi(dir_entry->d_name + 4);
+			break;
+		}
+		::closedir(dir);
+		return result;
+	}
+}
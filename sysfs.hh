@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <cstdint>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace powercap {
+
+	constexpr inline bool starts_with(std::string_view str, std::string_view prefix) {
+		auto const hsl = str.length();
+		auto const hl = prefix.length();
+		return hsl >= hl and std::string_view{ str.data(), hl }.compare(prefix) == 0;
+	}
+
+	constexpr inline bool is_digits(std::string_view str) {
+		if (str.empty())
+			return false;
+		for (auto c : str)
+			if (c < '0' or c > '9')
+				return false;
+		return true;
+	}
+
+	// Split off the next space separated token, for our own text files
+	std::string_view next_token(std::string_view& line);
+	bool to_uint64(std::string_view s, std::uint64_t& v);
+	bool to_double(std::string_view s, double& v);
+
+	// Calls f with each line of one of our own text files
+	template <typename F>
+	void for_each_line(std::string_view content, F f) {
+		while (not content.empty()) {
+			auto const nl = content.find('\n');
+			f(content.substr(0, nl));
+			content.remove_prefix(nl == content.npos ? content.size() : nl + 1);
+		}
+	}
+
+	// Rounded down to whole watts, like everything we write to power1_cap
+	std::uint64_t whole_watts(std::uint64_t uw);
+
+	// Returns the first line
+	std::optional<std::string> read_string_from(std::string const& p);
+	// Returns the whole content, meant for our own (small) files
+	std::optional<std::string> read_file(std::string const& p);
+	std::optional<std::uint64_t> read_dec_uint64_value_from(std::string const& p);
+
+	int write_dec_uint64_value_to(std::string const& p, std::uint64_t v);
+	int write_dec_uint64_value_to(std::string const& p, std::optional<std::uint64_t> const& v);
+
+	// Values of pwm1_enable
+	constexpr std::uint64_t pwm_manual = 1;
+	constexpr std::uint64_t pwm_automatic = 2;
+
+	// A sysfs attribute that is kept open, so polling it is a single pread
+	// instead of open, read and close each time. It gets opened on the
+	// first read.
+	class Attribute {
+	public:
+		Attribute() = default;
+		explicit Attribute(std::string path) : m_path{ std::move(path) } {}
+		~Attribute();
+
+		Attribute(Attribute&& o) noexcept;
+		Attribute& operator=(Attribute&& o) noexcept;
+		Attribute(Attribute const&) = delete;
+		Attribute& operator=(Attribute const&) = delete;
+
+		// The first line, only valid until the next read
+		std::optional<std::string_view> read_line();
+		// As much of the content as fits into buf
+		std::optional<std::string_view> read(char* buf, std::size_t size);
+		std::optional<std::uint64_t> read_uint64();
+
+	private:
+		std::string m_path;
+		int m_fd = -1;
+		char m_buf[64];
+	};
+
+	// Write power1_cap of the hwmon and log what we do
+	int set_power_cap(std::string const& hwmon, std::optional<std::uint64_t> const& uw);
+
+	// Try to find the first card entry
+	std::string find_card_base_path();
+
+	// Try to figure the hwmon entry
+	std::string find_hwmon_base_path(std::string const& p);
+
+	// The hwmon entries of all cards that allow to set a power-limit
+	std::vector<std::string> find_all_hwmon_base_paths();
+
+	// Resolve whatever udev (or the user) handed us to a hwmon entry. This can
+	// be the hwmon device itself, the drm card or the pci device.
+	std::string find_hwmon_base_path_for_device(std::string const& p);
+
+	// The pci slot (e.g. 0000:03:00.0) the hwmon belongs to, it survives
+	// driver reloads unlike the card and hwmon numbers.
+	std::string pci_slot_of(std::string const& hwmon);
+
+	// The N of the drm cardN the hwmon belongs to, -1 if there is none
+	int card_index_of(std::string const& hwmon);
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * What calibrate and autotune have in common: both step through the caps
+ * of a card the user keeps busy, may get interrupted any time, and keep
+ * what they found in a small text table.
+ */
+
+#include "trial.hh"
+#include "state.hh"
+#include "sysfs.hh"
+
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace powercap {
+
+	namespace {
+
+		constexpr char const* table_dir = "/var/lib/powercap";
+
+		void on_signal(int) {
+			interrupted = 1;
+		}
+	}
+
+	volatile std::sig_atomic_t interrupted = 0;
+
+	void catch_interrupts() {
+		struct sigaction sa{};
+		sa.sa_handler = on_signal;
+		::sigaction(SIGINT, &sa, nullptr);
+		::sigaction(SIGTERM, &sa, nullptr);
+	}
+
+	CapTrial::CapTrial(std::string hwmon, std::uint64_t original, std::string const& what)
+		: m_hwmon{ std::move(hwmon) }
+		, m_original{ original }
+	{
+		if (claim_card(m_hwmon, m_original) == -EBUSY) {
+			std::fprintf(stderr, "%s is in use by another powercap, skipped\n", pci_slot_of(m_hwmon).c_str());
+			return;
+		}
+		m_claimed = true;
+		std::printf("%s, keep it busy until we are done...\n", what.c_str());
+	}
+
+	CapTrial::~CapTrial() {
+		if (not m_claimed)
+			return;
+		set(m_original);
+		release_card(m_hwmon, static_cast<std::uint64_t>(::getpid()));
+	}
+
+	int CapTrial::set(std::uint64_t cap) {
+		if (not m_claimed)
+			return -EBUSY;
+		if (auto const err = set_power_cap(m_hwmon, cap); err < 0)
+			return err;
+		record_cap(m_hwmon, cap);
+		return 0;
+	}
+
+	int save_table(char const* path, std::string const& content) {
+		if (::mkdir(table_dir, 0755) < 0 and errno != EEXIST)
+			return -errno;
+		auto const tmp = std::string{ path } + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -errno;
+		auto const n = ::write(fd, content.data(), content.size());
+		int err = n < 0 ? -errno : 0;
+		::close(fd);
+		if (err == 0 and ::rename(tmp.c_str(), path) < 0)
+			err = -errno;
+		return err;
+	}
+}
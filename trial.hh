@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <string>
+
+namespace powercap {
+
+	// Set once SIGINT or SIGTERM arrived, see catch_interrupts()
+	extern volatile std::sig_atomic_t interrupted;
+
+	// Whatever happens, the original caps have to be restored, so the
+	// signals only end the measurement early
+	void catch_interrupts();
+
+	// A card whose caps get tried out while the user keeps it busy. It is
+	// ours in the run state meanwhile, so the watch daemon does not put its
+	// own cap back, and gets its original cap back at the end. A card that
+	// belongs to another run, calibrate or autotune is left alone.
+	class CapTrial {
+	public:
+		// what is printed along with the request to keep the card busy,
+		// e.g. "Tuning 0000:03:00.0"
+		CapTrial(std::string hwmon, std::uint64_t original, std::string const& what);
+		~CapTrial();
+
+		CapTrial(CapTrial const&) = delete;
+		CapTrial& operator=(CapTrial const&) = delete;
+
+		// False if the card is in use by someone else
+		bool claimed() const {
+			return m_claimed;
+		}
+
+		int set(std::uint64_t cap);
+
+	private:
+		std::string m_hwmon;
+		std::uint64_t m_original;
+		bool m_claimed = false;
+	};
+
+	// Replace one of our tables in /var/lib/powercap, through a temporary
+	// file so readers never see half of it
+	int save_table(char const* path, std::string const& content);
+}
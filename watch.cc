@@ -0,0 +1,985 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+/*
+ * Other tools (or a driver reset) may overwrite power1_cap behind our back.
+ * We periodically compare the effective value with the one recorded in the
+ * run state and write ours again, unless someone keeps fighting us.
+ *
+ * With a config the rules decide what the value should be, so schedules
+ * take effect while we run. The config is reloaded when it changes. Cards
+ * it asks to equalize share a budget instead, which is shifted towards the
+ * slowest card while all of them are busy.
+ *
+ * We are here to save power, so we must not burn it ourselves. All cards
+ * are handled in a single round, rounds are aligned to full seconds to
+ * share wakeups with other timers, and we slow down while every card is
+ * idle or suspended. After a change we look again soon, to catch whoever
+ * might fight us.
+ *
+ * Cards can belong to another process for a while, e.g. powercap run.
+ * They are left alone while it runs, and put back once it is gone.
+ *
+ * Every round leaves a record per card in the flight recorder, which keeps
+ * what led up to a write failure, a reset, a thermal limit or a spike. The
+ * power samples also feed the energy counters.
+ *
+ * Each attribute is read at most once per round and card, whichever part
+ * asks for it, and the writes of a round go out before the reads that
+ * only feed the recorder. Those are held back once a card used up its
+ * read budget.
+ *
+ * On SIGHUP we re-execute the binary, which after an upgrade is the new
+ * one. The caps and cards are in the run state anyway, what only lives in
+ * our memory (counters, the re-assert history) is handed over in a memfd.
+ */
+
+#include "watch.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "alloc.hh"
+#include "config.hh"
+#include "energy.hh"
+#include "recorder.hh"
+#include "state.hh"
+#include "sysfs.hh"
+
+namespace powercap {
+
+	namespace {
+
+		using clock = std::chrono::steady_clock;
+
+		// How often we re-assert a cap within reassert_window, before we
+		// assume someone keeps changing it on purpose and back off.
+		constexpr unsigned reassert_burst = 3;
+		constexpr std::chrono::seconds reassert_window{ 600 };
+
+		// Tools known to write power1_cap. The kernel does not tell us who
+		// changed an attribute, so these are only reported as suspects.
+		constexpr std::array<std::string_view, 4> known_writers = {
+			"corectrl",
+			"corectrl_helper",
+			"lact",
+			"coolercontrold",
+		};
+
+		// Rounds stretch by this factor while all cards are idle, and shrink
+		// by it for a few rounds after a change.
+		constexpr unsigned idle_factor = 6;
+		constexpr unsigned fast_factor = 4;
+		constexpr unsigned fast_rounds_after_change = 3;
+		// Below this gpu_busy_percent a card counts as idle
+		constexpr double idle_busy_percent = 5;
+		// Draw above the cap by this factor is a spike, and this close to
+		// temp1_crit (in m°C) we count as thermally limited.
+		constexpr double spike_factor = 1.1;
+		constexpr std::uint64_t thermal_margin = 5000;
+		constexpr std::uint32_t recorded_signals = (1u << Signal::Temp) | (1u << Signal::Busy) | (1u << Signal::Power);
+		// Equalizing moves this much (uW) per round, only while all cards
+		// are at least this busy. The clocks are smoothed over a few rounds.
+		constexpr std::uint64_t equalize_step = 5000000;
+		constexpr double sclk_smoothing = 0.3;
+
+		volatile std::sig_atomic_t terminate = 0;
+		volatile std::sig_atomic_t report = 0;
+		volatile std::sig_atomic_t upgrade = 0;
+
+		void on_signal(int sig) {
+			if (sig == SIGUSR1)
+				report = 1;
+			else if (sig == SIGHUP)
+				upgrade = 1;
+			else
+				terminate = 1;
+		}
+
+		std::int64_t to_ns(clock::time_point t) {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+		}
+
+		// CLOCK_MONOTONIC keeps counting across exec, so the values stay
+		// meaningful for the new instance.
+		clock::time_point from_ns(std::int64_t ns) {
+			return clock::time_point{ std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds{ ns }) };
+		}
+
+		// One timer for all periodic work. Expirations are absolute and
+		// rounded up to full seconds, the same trick as round_jiffies(), so
+		// our wakeups coincide with those of other timers.
+		class Ticker {
+		public:
+			Ticker() : m_fd{ ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) } {}
+
+			~Ticker() {
+				if (m_fd >= 0)
+					::close(m_fd);
+			}
+
+			Ticker(Ticker const&) = delete;
+			Ticker& operator=(Ticker const&) = delete;
+
+			int fd() const {
+				return m_fd;
+			}
+
+			void arm(unsigned seconds) {
+				struct timespec now;
+				::clock_gettime(CLOCK_MONOTONIC, &now);
+				struct itimerspec its{};
+				its.it_value.tv_sec = now.tv_sec + seconds + (now.tv_nsec > 0 ? 1 : 0);
+				::timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+			}
+
+			// True if the timer expired since the last call
+			bool expired() {
+				std::uint64_t n = 0;
+				return ::read(m_fd, &n, sizeof(n)) == sizeof(n) and n > 0;
+			}
+
+		private:
+			int m_fd;
+		};
+
+		// What it costs to run us
+		class SelfStats {
+		public:
+			void woke_up() {
+				++m_wakeups;
+			}
+
+			// A round that neither changed anything nor had to reload
+			// anything must not touch the heap.
+			void quiet_round(std::uint64_t allocations) {
+				if (allocations == 0)
+					return;
+				if (m_allocating_rounds++ == 0)
+					std::fprintf(stderr, "A round without changes did %" PRIu64 " heap allocations\n", allocations);
+			}
+
+			void print() const {
+				auto const secs = std::chrono::duration<double>(clock::now() - m_start).count();
+				struct rusage ru{};
+				::getrusage(RUSAGE_SELF, &ru);
+				auto const cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0
+					+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+				std::printf("Woke up %" PRIu64 " times in %.0fs (%.3f/s), used %.1fms of cpu time\n",
+					m_wakeups, secs, secs > 0 ? m_wakeups / secs : 0, cpu_ms);
+				std::printf("%" PRIu64 " heap allocations in total, %" PRIu64 " rounds without changes allocated\n",
+					allocation_count(), m_allocating_rounds);
+			}
+
+			void save(int fd) const {
+				::dprintf(fd, "stats %" PRIu64 " %" PRIu64 " %" PRId64 "\n",
+					m_wakeups, m_allocating_rounds, to_ns(m_start));
+			}
+
+			// Continue counting where the previous instance stopped
+			bool restore(char const* line) {
+				std::int64_t start = 0;
+				if (std::sscanf(line, "stats %" SCNu64 " %" SCNu64 " %" SCNd64,
+						&m_wakeups, &m_allocating_rounds, &start) != 3)
+					return false;
+				m_start = from_ns(start);
+				return true;
+			}
+
+		private:
+			clock::time_point m_start = clock::now();
+			std::uint64_t m_wakeups = 0;
+			std::uint64_t m_allocating_rounds = 0;
+		};
+
+		struct Watched {
+			CardState card;
+			std::uint64_t drifts = 0;
+			std::uint64_t reasserts = 0;
+			std::uint64_t suppressed = 0;
+			// The foreign value we last reported, to not repeat ourselves
+			std::uint64_t reported = 0;
+			// Ring of the last re-assert times, used for rate limiting
+			std::array<clock::time_point, reassert_burst> reasserted_at{};
+			unsigned next = 0;
+			bool backed_off = false;
+			// Lost with its hwmon, until it shows up again
+			bool gone = false;
+			// Another process changes it for now, see Owner
+			bool owned = false;
+			// For the recorder, what happened this and the last round
+			std::uint8_t events = 0;
+			std::uint8_t last_events = 0;
+			std::optional<std::size_t> energy;
+			// Whether it shares the equalize budget, and its last busy
+			// percentage and smoothed sclk
+			bool equalized = false;
+			// Whether it was counted for the equal shares, and the share it
+			// got, 0 until it got it
+			bool sharing = false;
+			std::uint64_t share = 0;
+			double busy = 0;
+			double sclk = 0;
+			CardIdentity id;
+			Policy policy = Policy::Enforce;
+			// Kept open between rounds, recreated when the hwmon changes
+			std::optional<CardAttributes> attrs;
+
+			CardAttributes& attributes() {
+				if (not attrs or attrs->hwmon() != card.hwmon)
+					attrs.emplace(card.hwmon);
+				return *attrs;
+			}
+		};
+
+		// Tells us when the config got written, replaced or removed. Editors
+		// like to replace files via rename, so once the file is gone it gets
+		// looked up again. Only while there is none we watch the directory,
+		// for it to show up.
+		class ConfigWatch {
+		public:
+			explicit ConfigWatch(char const* path) : m_path{ path } {
+				if (path == nullptr)
+					return;
+				std::string_view const p{ path };
+				auto const slash = p.rfind('/');
+				m_dir = slash == p.npos ? std::string{ "." } : std::string{ p.substr(0, slash ? slash : 1) };
+				m_name = slash == p.npos ? p : p.substr(slash + 1);
+				m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+				if (m_fd >= 0)
+					arm();
+			}
+
+			~ConfigWatch() {
+				if (m_fd >= 0)
+					::close(m_fd);
+			}
+
+			ConfigWatch(ConfigWatch const&) = delete;
+			ConfigWatch& operator=(ConfigWatch const&) = delete;
+
+			int fd() const {
+				return m_fd;
+			}
+
+			// Drains pending events, true if one of them was about our file
+			bool changed() {
+				alignas(struct inotify_event) char buf[4096];
+				bool result = false;
+				bool replaced = false;
+				ssize_t n;
+				while ((n = ::read(m_fd, buf, sizeof(buf))) > 0) {
+					for (char* p = buf; p < buf + n; ) {
+						auto const* ev = reinterpret_cast<struct inotify_event const*>(p);
+						if (ev->wd == m_file_wd) {
+							result = true;
+							if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+								replaced = true;
+						} else if (ev->wd == m_dir_wd and ev->len > 0 and m_name == ev->name) {
+							result = true;
+							replaced = true;
+						}
+						p += sizeof(struct inotify_event) + ev->len;
+					}
+				}
+				if (replaced)
+					arm();
+				return result;
+			}
+
+		private:
+			void arm() {
+				if (m_file_wd >= 0)
+					::inotify_rm_watch(m_fd, m_file_wd);
+				m_file_wd = ::inotify_add_watch(m_fd, m_path, IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+				if (m_file_wd >= 0) {
+					if (m_dir_wd >= 0)
+						::inotify_rm_watch(m_fd, m_dir_wd);
+					m_dir_wd = -1;
+				} else if (m_dir_wd < 0) {
+					m_dir_wd = ::inotify_add_watch(m_fd, m_dir.c_str(), IN_CREATE | IN_MOVED_TO);
+				}
+			}
+
+			char const* m_path;
+			std::string m_dir;
+			std::string_view m_name;
+			int m_fd = -1;
+			int m_file_wd = -1;
+			int m_dir_wd = -1;
+		};
+
+		// Returns something like "corectrl_helper[812] lact[1022]"
+		std::string running_known_writers() {
+			std::string result;
+			DIR* dir = ::opendir("/proc");
+			if (dir == nullptr)
+				return result;
+			while (auto const* dir_entry = ::readdir(dir)) {
+				std::string_view const pid{ dir_entry->d_name };
+				if (not is_digits(pid))
+					continue;
+				auto const comm = read_string_from("/proc/" + std::string{ pid } + "/comm");
+				if (not comm.has_value())
+					continue;
+				for (auto const w : known_writers) {
+					if (*comm != w)
+						continue;
+					if (not result.empty())
+						result += ' ';
+					result += *comm + "[" + std::string{ pid } + "]";
+				}
+			}
+			::closedir(dir);
+			return result;
+		}
+
+		bool may_reassert(Watched& w, clock::time_point now) {
+			auto& oldest = w.reasserted_at[w.next];
+			if (oldest != clock::time_point{} and now - oldest < reassert_window)
+				return false;
+			oldest = now;
+			w.next = (w.next + 1) % reassert_burst;
+			return true;
+		}
+
+		// After a driver reload the hwmon (and maybe the card) got a new
+		// number, look it up again through the pci slot.
+		bool rediscover(CardState& c) {
+			auto const hwmon = find_hwmon_base_path_for_device("/sys/bus/pci/devices/" + c.slot);
+			if (hwmon.empty())
+				return false;
+			c.hwmon = hwmon;
+			if (not stamp(c))
+				return false;
+
+			RunStateLock const lock;
+			auto state = load_run_state();
+			if (auto* s = state.find(c.slot)) {
+				s->hwmon = c.hwmon;
+				s->ino = c.ino;
+				s->mtime_ns = c.mtime_ns;
+				save_run_state(state);
+			}
+			return true;
+		}
+
+		// Returns true if someone changed the cap
+		bool check(Watched& w, bool verbose) {
+			auto& c = w.card;
+			if (w.policy == Policy::Once)
+				return false;
+			// Reading from a suspended device would wake it up, and while it
+			// sleeps nobody can change the cap anyway.
+			auto& attrs = w.attributes();
+			if (attrs.is_suspended())
+				return false;
+
+			auto const current = attrs.cap();
+			if (not current.has_value() or *current == c.cap)
+				return false;
+
+			if (*current != w.reported) {
+				w.events |= Drift;
+				++w.drifts;
+				w.reported = *current;
+				auto const suspects = running_known_writers();
+				std::fprintf(stderr, "power1_cap of %s changed from %" PRIu64 "W to %" PRIu64 "W%s%s%s\n",
+					c.slot.c_str(), c.cap / 1000000, *current / 1000000,
+					suspects.empty() ? "" : " (running: ", suspects.c_str(), suspects.empty() ? "" : ")");
+			}
+
+			if (not may_reassert(w, clock::now())) {
+				++w.suppressed;
+				if (not w.backed_off)
+					std::fprintf(stderr, "power1_cap of %s keeps changing, no longer re-asserting it for now\n",
+						c.slot.c_str());
+				w.backed_off = true;
+				return true;
+			}
+			w.backed_off = false;
+
+			if (auto const err = attrs.set_cap(c.cap); err < 0) {
+				w.events |= WriteFailed;
+				std::fprintf(stderr, "Could not write %s\n", std::strerror(-err));
+				return true;
+			}
+			w.events |= Applied;
+			++w.reasserts;
+			w.reported = 0;
+			if (verbose)
+				std::printf("%s: %" PRIu64 " drifts, %" PRIu64 " re-asserted, %" PRIu64 " suppressed\n",
+					c.slot.c_str(), w.drifts, w.reasserts, w.suppressed);
+			return true;
+		}
+
+		// Returns true if the cap got written
+		bool write_cap(Watched& w, std::uint64_t cap) {
+			auto& c = w.card;
+			// It may have been claimed since the round started
+			auto const state = load_run_state();
+			if (auto const* known = state.find(c.slot); known and owner_alive(*known)) {
+				c.owner = known->owner;
+				w.owned = true;
+				return false;
+			}
+			if (auto const err = w.attributes().set_cap(cap); err < 0) {
+				w.events |= WriteFailed;
+				std::fprintf(stderr, "Could not write %s\n", std::strerror(-err));
+				return false;
+			}
+			w.events |= Applied;
+			c.cap = cap;
+			// Only the cap, whatever else is in the file may be newer than
+			// what we know
+			record_cap(c.hwmon, cap);
+			return true;
+		}
+
+		// Puts the card back the way its owner found it, the owner died
+		// before it could do that itself. Returns true if the cap changed.
+		bool disown(Watched& w) {
+			auto& c = w.card;
+			// It gets put back once it is awake
+			if (w.attributes().is_suspended())
+				return false;
+			std::fprintf(stderr, "Process %" PRIu64 " is gone, restoring power1_cap of %s to %" PRIu64 "W\n",
+				c.owner.pid, c.slot.c_str(), c.owner.cap / 1000000);
+			if (c.owner.fan != 0 and write_dec_uint64_value_to(c.hwmon + "/pwm1_enable", pwm_automatic) == 0)
+				std::fprintf(stderr, "Back to automatic fan control on %s\n", c.slot.c_str());
+			auto const cap = c.owner.cap;
+			bool const changed = cap != 0 and cap != c.cap and write_cap(w, cap);
+			release_card(c.hwmon, c.owner.pid);
+			c.owner = {};
+			return changed;
+		}
+
+		// Whether the card shares the equalize budget, also while it is owned
+		// since its cap still counts
+		void classify(Watched& w, RuleTable const* rules) {
+			if (w.id.slot.empty())
+				w.id = identify(w.card.hwmon);
+			w.equalized = rules and rules->equalize and matches(rules->equalize->selectors, w.id);
+		}
+
+		// Switch to whatever the config asks for right now, e.g. when a
+		// schedule starts or ends or the config got changed. Returns true if
+		// the cap changed.
+		bool apply_rules(Watched& w, RuleTable const& rules, unsigned minute, bool verbose) {
+			auto& c = w.card;
+			if (w.equalized)
+				return false;
+			auto const* rule = rules.match(w.id);
+			if (rule == nullptr)
+				return false;
+			w.policy = rule->policy;
+			auto& attrs = w.attributes();
+			if (attrs.is_suspended())
+				return false;
+
+			auto const& profile = rules.profile_for(*rule, minute);
+			auto const cap = resolve(profile.cap, attrs);
+			if (not cap.has_value() or *cap == c.cap)
+				return false;
+			if (verbose)
+				std::printf("Applying profile %s to %s...\n", profile.name.c_str(), c.slot.c_str());
+			return write_cap(w, *cap);
+		}
+
+		// What the cards got equal shares of, the budget less the caps of
+		// the members someone else owns. A change of it or of the cards
+		// starts over from equal shares.
+		struct Sharing {
+			std::uint64_t budget = 0;
+			// Too small for the cards, they are left alone until it changes
+			bool impossible = false;
+		};
+
+		// Starts from equal shares of the budget whenever cards join or
+		// leave or the budget changes, e.g. by an owned card's cap. Then, while all cards are busy, the
+		// fastest one gives equalize_step to the slowest one until their
+		// clocks are within the tolerance. Returns true if a cap changed.
+		bool equalize(std::vector<Watched>& watched, Equalize const& e, Sharing& sharing, bool verbose) {
+			auto const member = [](Watched const& w) { return w.equalized and not w.gone and not w.owned; };
+			// Cards in use by run, calibrate or autotune keep their cap, the
+			// others share what is left
+			std::uint64_t owned = 0;
+			for (auto const& w : watched)
+				if (w.equalized and not w.gone and w.owned)
+					owned += w.card.cap;
+			auto const budget = e.budget > owned ? e.budget - owned : 0;
+			unsigned n = 0;
+			bool reshare = budget != sharing.budget;
+			for (auto const& w : watched) {
+				if (member(w))
+					++n;
+				if (member(w) != w.sharing)
+					reshare = true;
+			}
+			auto const share = equal_share(budget, n);
+			if (reshare) {
+				sharing.budget = budget;
+				sharing.impossible = false;
+				for (auto& w : watched) {
+					w.sharing = member(w);
+					w.share = 0;
+				}
+				if (verbose and n > 0)
+					std::printf("Sharing %" PRIu64 "W between %u cards\n", budget / 1000000, n);
+			}
+			if (sharing.impossible)
+				return false;
+
+			// Lower caps first, the budget must never be exceeded. Cards
+			// sleeping would wake up from reading their limits, they get
+			// their share once they are back.
+			bool changed = false;
+			bool pending = false;
+			for (bool const lowering : { true, false }) {
+				for (auto& w : watched) {
+					if (not w.sharing or w.share == share or (w.card.cap > share) != lowering)
+						continue;
+					auto& attrs = w.attributes();
+					if (attrs.is_suspended()) {
+						pending = true;
+						continue;
+					}
+					if (auto const min = attrs.cap_min(); min and *min > share) {
+						std::fprintf(stderr, "equalize budget of %" PRIu64 "W is too small for %u cards, %s needs at "
+							"least %" PRIu64 "W\n", budget / 1000000, n, w.card.slot.c_str(), *min / 1000000);
+						sharing.impossible = true;
+						return changed;
+					}
+					auto const cap = resolve(CapSpec{ CapSpec::Watts, share, nullptr }, attrs);
+					if (not cap.has_value()) {
+						pending = true;
+						continue;
+					}
+					if (*cap != w.card.cap) {
+						if (not write_cap(w, *cap)) {
+							pending = true;
+							continue;
+						}
+						changed = true;
+					}
+					w.share = share;
+				}
+			}
+			if (changed or pending)
+				return changed;
+
+			bool all_busy = true;
+			Watched* fastest = nullptr;
+			Watched* slowest = nullptr;
+			for (auto& w : watched) {
+				if (not w.sharing)
+					continue;
+				if (w.busy < loaded_busy_percent or w.sclk == 0)
+					all_busy = false;
+				if (fastest == nullptr or w.sclk > fastest->sclk)
+					fastest = &w;
+				if (slowest == nullptr or w.sclk < slowest->sclk)
+					slowest = &w;
+			}
+			if (n < 2 or not all_busy or fastest->sclk - slowest->sclk <= e.tolerance)
+				return false;
+
+			auto const min = fastest->attributes().cap_min();
+			auto const max = slowest->attributes().cap_max();
+			if (not min or not max or fastest->card.cap < *min + equalize_step
+				or slowest->card.cap + equalize_step > *max)
+			{
+				return false;
+			}
+			if (verbose)
+				std::printf("Moving %" PRIu64 "W from %s (%.0fMHz) to %s (%.0fMHz)\n", equalize_step / 1000000,
+					fastest->card.slot.c_str(), fastest->sclk, slowest->card.slot.c_str(), slowest->sclk);
+			// Take first, the budget must never be exceeded
+			if (not write_cap(*fastest, fastest->card.cap - equalize_step))
+				return false;
+			write_cap(*slowest, slowest->card.cap + equalize_step);
+			return true;
+		}
+
+		// Leaves the round in the recorder and the energy counters, and dumps
+		// the recorder when something new went wrong. Returns true if the card
+		// is idle.
+		bool record(Watched& w, Recorder& recorder, EnergyCounters& energy) {
+			auto& attrs = w.attributes();
+			bool const suspended = attrs.is_suspended();
+			auto const s = suspended ? Signals{} : attrs.monitor(recorded_signals);
+
+			if (not w.energy.has_value())
+				w.energy = energy.counter_for(attrs.hwmon(), w.card.slot);
+			energy.add(*w.energy, s[Signal::Power], clock::now());
+
+			w.busy = s[Signal::Busy];
+			if (auto const mhz = w.equalized and not suspended ? attrs.sclk() : std::nullopt)
+				w.sclk = w.sclk == 0 ? *mhz : w.sclk + sclk_smoothing * (*mhz - w.sclk);
+
+			Record r;
+			struct timespec now;
+			::clock_gettime(CLOCK_REALTIME, &now);
+			r.time_ns = static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+			std::strncpy(r.slot, w.card.slot.c_str(), sizeof(r.slot) - 1);
+			r.cap = w.card.cap;
+			r.power = static_cast<std::uint32_t>(s[Signal::Power] * 1000);
+			r.temp = static_cast<std::int32_t>(s[Signal::Temp] * 1000);
+			r.busy = static_cast<std::uint8_t>(s[Signal::Busy]);
+			// Only when it clearly is, not because of one noisy reading
+			if (r.cap > 0 and (s[Signal::Power] - attrs.power_error()) * 1000000 > r.cap * spike_factor)
+				w.events |= Spike;
+			if (auto const crit = attrs.temp_crit(); crit.has_value() and not suspended
+				and static_cast<std::uint64_t>(std::max(r.temp, 0)) + thermal_margin >= *crit)
+				w.events |= Thermal;
+			r.events = w.events;
+			recorder.add(r);
+
+			// Only when it starts, a card running hot for hours is one event
+			if (auto const fresh = w.events & dump_events & ~w.last_events)
+				recorder.dump(static_cast<std::uint8_t>(fresh));
+			w.last_events = w.events;
+			w.events = 0;
+			return suspended or s[Signal::Busy] < idle_busy_percent;
+		}
+
+		// Pick up cards and caps applied by other invocations (udev, the
+		// oneshot service or the user) since the last round. Returns true if
+		// the state had to be read again.
+		bool sync_with_run_state(std::vector<Watched>& watched, std::uint64_t& generation) {
+			auto const current = run_state_generation();
+			if (current == generation)
+				return false;
+			generation = current;
+
+			auto const state = load_run_state();
+			for (auto const& c : state.cards) {
+				if (c.cap == 0)
+					continue;
+				bool found = false;
+				for (auto& w : watched) {
+					if (w.card.slot != c.slot)
+						continue;
+					w.card = c;
+					found = true;
+				}
+				if (found)
+					continue;
+				Watched w;
+				w.card = c;
+				watched.push_back(std::move(w));
+			}
+			return true;
+		}
+
+		void print_reads(std::vector<Watched> const& watched) {
+			for (auto const& w : watched)
+				if (w.attrs)
+					std::printf("%s: %" PRIu64 " device reads, %" PRIu64 " held back by the budget\n",
+						w.card.slot.c_str(), w.attrs->reads(), w.attrs->skipped());
+		}
+
+		void save(int fd, Watched const& w) {
+			::dprintf(fd, "card %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %d %u",
+				w.card.slot.c_str(), w.drifts, w.reasserts, w.suppressed, w.reported, w.backed_off ? 1 : 0, w.next);
+			for (auto const t : w.reasserted_at)
+				::dprintf(fd, " %" PRId64, to_ns(t));
+			// Equalize would start over from equal shares without these
+			::dprintf(fd, " %d %" PRIu64 " %.3f\n", w.sharing ? 1 : 0, w.share, w.sclk);
+		}
+
+		bool restore(char const* line, std::vector<Watched>& watched) {
+			char slot[64];
+			std::uint64_t drifts, reasserts, suppressed, reported;
+			int backed_off, pos = 0;
+			unsigned next;
+			if (std::sscanf(line, "card %63s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %d %u%n",
+					slot, &drifts, &reasserts, &suppressed, &reported, &backed_off, &next, &pos) != 7)
+				return false;
+			for (auto& w : watched) {
+				if (w.card.slot != slot)
+					continue;
+				w.drifts = drifts;
+				w.reasserts = reasserts;
+				w.suppressed = suppressed;
+				w.reported = reported;
+				w.backed_off = backed_off != 0;
+				w.next = next % reassert_burst;
+				char const* p = line + pos;
+				for (auto& t : w.reasserted_at) {
+					std::int64_t ns;
+					int n;
+					if (std::sscanf(p, " %" SCNd64 "%n", &ns, &n) != 1)
+						break;
+					t = from_ns(ns);
+					p += n;
+				}
+				// Missing when handed over by an older version
+				int sharing;
+				std::uint64_t share;
+				double sclk;
+				if (std::sscanf(p, " %d %" SCNu64 " %lf", &sharing, &share, &sclk) == 3) {
+					w.sharing = sharing != 0;
+					w.share = share;
+					w.sclk = sclk;
+				}
+			}
+			return true;
+		}
+
+		// After an upgrade /proc/self/exe points to the deleted old binary,
+		// the new one got installed under the same name.
+		std::string executable() {
+			std::array<char, PATH_MAX> buf;
+			auto const n = ::readlink("/proc/self/exe", buf.data(), buf.size());
+			if (n <= 0)
+				return {};
+			std::string_view path{ buf.data(), static_cast<std::size_t>(n) };
+			constexpr std::string_view deleted = " (deleted)";
+			if (path.size() > deleted.size() and path.substr(path.size() - deleted.size()) == deleted)
+				path.remove_suffix(deleted.size());
+			return std::string{ path };
+		}
+
+		// Replaces us with a fresh instance of the binary, only returns if
+		// that failed.
+		void hand_over(char* const* argv, std::vector<Watched> const& watched, SelfStats const& stats,
+			unsigned fast_rounds, Sharing const& sharing)
+		{
+			auto const path = executable();
+			if (argv == nullptr or path.empty())
+				return;
+			// Not close-on-exec, the new instance reads it from the start
+			int const fd = ::memfd_create("powercap-handoff", 0);
+			if (fd < 0) {
+				std::fprintf(stderr, "Could not hand over: %s\n", std::strerror(errno));
+				return;
+			}
+			::dprintf(fd, "powercap-handoff 1\n");
+			stats.save(fd);
+			::dprintf(fd, "fast %u\n", fast_rounds);
+			::dprintf(fd, "sharing %" PRIu64 " %d\n", sharing.budget, sharing.impossible ? 1 : 0);
+			for (auto const& w : watched)
+				save(fd, w);
+			::lseek(fd, 0, SEEK_SET);
+
+			std::array<char, 16> value;
+			std::snprintf(value.data(), value.size(), "%d", fd);
+			::setenv(handoff_env, value.data(), 1);
+			std::printf("Re-executing %s\n", path.c_str());
+			std::fflush(nullptr);
+			::execv(path.c_str(), argv);
+
+			auto const err = errno;
+			::unsetenv(handoff_env);
+			::close(fd);
+			std::fprintf(stderr, "Could not execute %s: %s\n", path.c_str(), std::strerror(err));
+		}
+
+		// Takes over what hand_over() left us, closes fd
+		void take_over(int fd, std::vector<Watched>& watched, SelfStats& stats, unsigned& fast_rounds,
+			Sharing& sharing)
+		{
+			FILE* f = ::fdopen(fd, "r");
+			if (f == nullptr) {
+				::close(fd);
+				return;
+			}
+			char line[512];
+			if (std::fgets(line, sizeof(line), f) == nullptr or std::strcmp(line, "powercap-handoff 1\n") != 0) {
+				std::fprintf(stderr, "Ignoring state handed over in an unknown format\n");
+				std::fclose(f);
+				return;
+			}
+			while (std::fgets(line, sizeof(line), f) != nullptr) {
+				if (stats.restore(line) or restore(line, watched))
+					continue;
+				int impossible;
+				if (std::sscanf(line, "sharing %" SCNu64 " %d", &sharing.budget, &impossible) == 2)
+					sharing.impossible = impossible != 0;
+				else
+					std::sscanf(line, "fast %u", &fast_rounds);
+			}
+			std::fclose(f);
+		}
+	}
+
+	int watch(WatchOptions const& o) {
+		struct sigaction sa{};
+		sa.sa_handler = on_signal;
+		::sigaction(SIGTERM, &sa, nullptr);
+		::sigaction(SIGINT, &sa, nullptr);
+		::sigaction(SIGUSR1, &sa, nullptr);
+		::sigaction(SIGHUP, &sa, nullptr);
+		// Only delivered while we wait in ppoll, one arriving just before we
+		// go to sleep still wakes us. They stay blocked across the exec on
+		// SIGHUP, so the new instance gets what arrived in between.
+		sigset_t handled;
+		sigemptyset(&handled);
+		for (int sig : { SIGTERM, SIGINT, SIGUSR1, SIGHUP })
+			sigaddset(&handled, sig);
+		sigset_t waiting;
+		::sigprocmask(SIG_BLOCK, &handled, &waiting);
+		for (int sig : { SIGTERM, SIGINT, SIGUSR1, SIGHUP })
+			sigdelset(&waiting, sig);
+
+		// We end up in the journal, make sure lines show up as they happen
+		std::setvbuf(stdout, nullptr, _IOLBF, 0);
+
+		// Without a config there is nothing to complain about, it gets picked
+		// up once it shows up
+		std::shared_ptr<RuleTable const> rules;
+		if (o.config != nullptr and ::access(o.config, F_OK) == 0) {
+			std::string error;
+			rules = load_config(o.config, error);
+			if (not rules)
+				std::fprintf(stderr, "%s\n", error.c_str());
+		}
+		ConfigWatch config_watch{ o.config };
+		Ticker ticker;
+		SelfStats stats;
+		Recorder recorder{ recorder_dir };
+		EnergyCounters energy;
+
+		std::vector<Watched> watched;
+		std::uint64_t generation = 0;
+		unsigned fast_rounds = 0;
+		Sharing sharing;
+		if (o.handoff >= 0) {
+			// The counters belong to cards we know from the run state. The
+			// first round still reads it again, like after a fresh start.
+			std::uint64_t handed_over = 0;
+			sync_with_run_state(watched, handed_over);
+			take_over(o.handoff, watched, stats, fast_rounds, sharing);
+		}
+		bool round_due = true;
+		while (not terminate) {
+			if (round_due) {
+				auto const allocations = allocation_count();
+				bool changed = sync_with_run_state(watched, generation);
+				auto const minute = current_minute_of_day();
+				bool idle = true;
+				// Writes first, so they do not queue up behind the reads
+				// that only serve the recorder
+				for (auto& w : watched) {
+					w.gone = false;
+					if (not is_valid(w.card)) {
+						w.id = {};
+						changed = true;
+						w.gone = not rediscover(w.card);
+						if (w.gone) {
+							if (w.energy.has_value())
+								energy.pause(*w.energy);
+							continue;
+						}
+						w.events |= Reset;
+					}
+					auto& attrs = w.attributes();
+					attrs.next_round();
+					attrs.set_budget(o.read_budget);
+					// Its owner takes care of it, neither the config nor
+					// re-asserting our cap may get in the way
+					classify(w, rules.get());
+					w.owned = owner_alive(w.card);
+					if (w.owned)
+						continue;
+					if (w.card.owner.pid != 0 and disown(w))
+						changed = true;
+					if (rules and apply_rules(w, *rules, minute, o.verbose))
+						changed = true;
+					if (check(w, o.verbose))
+						changed = true;
+				}
+				for (auto& w : watched)
+					if (not w.gone and not record(w, recorder, energy))
+						idle = false;
+				if (rules and rules->equalize) {
+					if (equalize(watched, *rules->equalize, sharing, o.verbose))
+						changed = true;
+				} else {
+					sharing = {};
+				}
+				energy.checkpoint();
+
+				if (changed)
+					fast_rounds = fast_rounds_after_change;
+				else
+					stats.quiet_round(allocation_count() - allocations);
+				auto delay = o.interval;
+				if (fast_rounds > 0) {
+					--fast_rounds;
+					delay = std::max(1u, o.interval / fast_factor);
+				} else if (idle) {
+					delay = o.interval * idle_factor;
+				}
+				ticker.arm(delay);
+				round_due = false;
+			}
+
+			if (report) {
+				report = 0;
+				stats.print();
+				energy.print();
+				print_reads(watched);
+			}
+			if (upgrade) {
+				upgrade = 0;
+				energy.checkpoint(true);
+				hand_over(o.argv, watched, stats, fast_rounds, sharing);
+			}
+
+			std::array<struct pollfd, 2> pfds = {{
+				{ ticker.fd(), POLLIN, 0 },
+				{ config_watch.fd(), POLLIN, 0 },
+			}};
+			if (::ppoll(pfds.data(), pfds.size(), nullptr, &waiting) < 0)
+				continue;
+			stats.woke_up();
+			if (pfds[0].revents & POLLIN)
+				round_due = ticker.expired();
+			if (not (pfds[1].revents & POLLIN) or not config_watch.changed())
+				continue;
+
+			// Only replace the rules once the new ones turned out to be
+			// fine, a broken config must not disturb what is running.
+			std::string error;
+			if (auto r = load_config(o.config, error)) {
+				rules = std::move(r);
+				round_due = true;
+				std::printf("Reloaded %s\n", o.config);
+			} else {
+				std::fprintf(stderr, "Ignoring changed config, %s\n", error.c_str());
+			}
+		}
+
+		stats.print();
+		energy.checkpoint(true);
+		energy.print();
+		print_reads(watched);
+		for (auto const& w : watched)
+			std::printf("%s: %" PRIu64 " drifts, %" PRIu64 " re-asserted, %" PRIu64 " suppressed\n",
+				w.card.slot.c_str(), w.drifts, w.reasserts, w.suppressed);
+		return 0;
+	}
+}
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-2.1-or-later
+// Copyright 2024 Soeren Grunewald <soeren.grunewald@gmx.net>
+#pragma once
+
+namespace powercap {
+
+	// Holds the fd of the state handed over by the instance that re-executed
+	// us on SIGHUP.
+	constexpr char const* handoff_env = "POWERCAP_HANDOFF_FD";
+
+	struct WatchOptions {
+		// Seconds between two checks of the effective power1_cap
+		unsigned interval = 10;
+		bool verbose = false;
+		// Take the power-limits from the rules in this config
+		char const* config = nullptr;
+		// Device reads per card and minute, 0 for no limit
+		unsigned read_budget = 0;
+		// Our command line, to re-execute ourselves with on SIGHUP
+		char* const* argv = nullptr;
+		// State handed over by the previous instance, -1 if there is none
+		int handoff = -1;
+	};
+
+	// Keep the caps recorded in the run state in place until we get
+	// terminated, returns the exit code. On SIGHUP it re-executes the binary,
+	// e.g. after an upgrade, and the new one carries on where we stopped.
+	int watch(WatchOptions const& o);
+}